@@ -0,0 +1,417 @@
+
+// Multi-threaded allocator workloads.
+//
+// Links against one xmalloc backend, like the Collatz drivers, or against
+// all of them as alloc-bench, which takes $XMALLOC_BACKEND. It runs one
+// workload with a given number of threads. It prints throughput in
+// allocations per second, the p99 latency of a sample of xmalloc calls,
+// and the peak RSS of the process.
+//
+//   bench-opt WORKLOAD THREADS [OPS]
+//
+// OPS is the number of allocations each thread makes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+
+#define MAX_THREADS 64
+
+// time one xmalloc out of this many
+#define SAMPLE_EVERY 16
+
+typedef struct bench_thread {
+    int    id;
+    long   ops;
+    long   nsamples;
+    long*  samples;
+    unsigned int seed;
+} bench_thread;
+
+static int  nthreads;
+static long ops_per_thread;
+static pthread_barrier_t round_barrier;
+
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// xmalloc, with every SAMPLE_EVERY'th call timed.
+static
+void*
+bench_alloc(bench_thread* bt, size_t bytes)
+{
+    void* ptr;
+    if (bt->ops % SAMPLE_EVERY == 0) {
+        long t0 = now_ns();
+        ptr = xmalloc(bytes);
+        bt->samples[bt->nsamples++] = now_ns() - t0;
+    }
+    else {
+        ptr = xmalloc(bytes);
+    }
+
+    bt->ops++;
+    // touch the block so the backend can't hand out unmapped memory
+    *(char*)ptr = 1;
+    return ptr;
+}
+
+static
+long
+rand_range(bench_thread* bt, long lo, long hi)
+{
+    return lo + rand_r(&bt->seed) % (hi - lo + 1);
+}
+
+// Larson-style server churn: each thread replaces random slots in a
+// table of live objects. Between rounds the tables rotate one thread
+// over, so most frees hit blocks another thread allocated.
+
+#define LARSON_SLOTS  1000
+#define LARSON_ROUNDS 10
+
+static void** larson_tables[MAX_THREADS];
+
+static
+void
+larson(bench_thread* bt)
+{
+    void** slots = xmalloc(LARSON_SLOTS * sizeof(void*));
+    for (int ii = 0; ii < LARSON_SLOTS; ++ii) {
+        slots[ii] = bench_alloc(bt, rand_range(bt, 16, 256));
+    }
+    larson_tables[bt->id] = slots;
+
+    long per_round = (ops_per_thread - LARSON_SLOTS) / LARSON_ROUNDS;
+    for (int rr = 0; rr < LARSON_ROUNDS; ++rr) {
+        pthread_barrier_wait(&round_barrier);
+        slots = larson_tables[(bt->id + rr) % nthreads];
+
+        for (long ii = 0; ii < per_round; ++ii) {
+            long kk = rand_range(bt, 0, LARSON_SLOTS - 1);
+            xfree(slots[kk]);
+            slots[kk] = bench_alloc(bt, rand_range(bt, 16, 256));
+        }
+    }
+
+    pthread_barrier_wait(&round_barrier);
+    if (bt->id == 0) {
+        for (int tt = 0; tt < nthreads; ++tt) {
+            for (int ii = 0; ii < LARSON_SLOTS; ++ii) {
+                xfree(larson_tables[tt][ii]);
+            }
+            xfree(larson_tables[tt]);
+        }
+    }
+}
+
+// threadtest: allocate a batch of same-sized objects, free them all,
+// repeat. Nothing is shared between threads.
+
+#define THREADTEST_BATCH 1000
+
+static
+void
+threadtest(bench_thread* bt)
+{
+    void** objs = xmalloc(THREADTEST_BATCH * sizeof(void*));
+    while (bt->ops < ops_per_thread) {
+        for (int ii = 0; ii < THREADTEST_BATCH; ++ii) {
+            objs[ii] = bench_alloc(bt, 64);
+        }
+        for (int ii = 0; ii < THREADTEST_BATCH; ++ii) {
+            xfree(objs[ii]);
+        }
+    }
+    xfree(objs);
+}
+
+// Arena churn: like threadtest, but with 4 byte blocks. Those are too
+// small for opt's thread cache, so every call goes to the thread's own
+// arena. Any loss from adding threads is contention on allocator
+// metadata, since the threads share no data.
+
+#define ARENA_BATCH 64
+
+static
+void
+arena_churn(bench_thread* bt)
+{
+    void* objs[ARENA_BATCH];
+    while (bt->ops < ops_per_thread) {
+        for (int ii = 0; ii < ARENA_BATCH; ++ii) {
+            objs[ii] = bench_alloc(bt, 4);
+        }
+        for (int ii = 0; ii < ARENA_BATCH; ++ii) {
+            xfree(objs[ii]);
+        }
+    }
+}
+
+// Producer/consumer: threads pair up, the even thread allocates into a
+// single-producer single-consumer ring and the odd one frees what it
+// pops, so every free is a cross-thread free. A thread without a
+// partner does both.
+
+#define RING_SIZE 1024
+
+typedef struct ring {
+    void* items[RING_SIZE];
+    long  head;
+    long  tail;
+} ring;
+
+static ring rings[MAX_THREADS / 2];
+
+static
+void
+prodcons(bench_thread* bt)
+{
+    ring* rg = &rings[bt->id / 2];
+
+    if (bt->id % 2 == 0 && bt->id + 1 == nthreads) {
+        while (bt->ops < ops_per_thread) {
+            for (int ii = 0; ii < RING_SIZE; ++ii) {
+                rg->items[ii] = bench_alloc(bt, rand_range(bt, 8, 128));
+            }
+            for (int ii = 0; ii < RING_SIZE; ++ii) {
+                xfree(rg->items[ii]);
+            }
+        }
+        return;
+    }
+
+    if (bt->id % 2 == 0) {
+        for (long ii = 0; ii < 2 * ops_per_thread; ++ii) {
+            void* ptr = bench_alloc(bt, rand_range(bt, 8, 128));
+            long head = rg->head;
+            while (head - __atomic_load_n(&rg->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+                sched_yield();
+            }
+            rg->items[head % RING_SIZE] = ptr;
+            __atomic_store_n(&rg->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    else {
+        for (long ii = 0; ii < 2 * ops_per_thread; ++ii) {
+            long tail = rg->tail;
+            while (__atomic_load_n(&rg->head, __ATOMIC_ACQUIRE) == tail) {
+                sched_yield();
+            }
+            xfree(rg->items[tail % RING_SIZE]);
+            __atomic_store_n(&rg->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Realloc chains: each thread keeps a set of buffers and keeps resizing
+// random ones to random sizes, up to a few pages.
+
+#define REALLOC_BUFS 64
+
+static
+void
+realloc_chain(bench_thread* bt)
+{
+    char* bufs[REALLOC_BUFS];
+    for (int ii = 0; ii < REALLOC_BUFS; ++ii) {
+        bufs[ii] = bench_alloc(bt, 16);
+    }
+
+    while (bt->ops < ops_per_thread) {
+        long kk = rand_range(bt, 0, REALLOC_BUFS - 1);
+        long size = rand_range(bt, 1, 4 * 4096);
+
+        long t0 = 0;
+        if (bt->ops % SAMPLE_EVERY == 0) {
+            t0 = now_ns();
+        }
+        bufs[kk] = xrealloc(bufs[kk], size);
+        if (bt->ops % SAMPLE_EVERY == 0) {
+            bt->samples[bt->nsamples++] = now_ns() - t0;
+        }
+        bt->ops++;
+
+        bufs[kk][size - 1] = 1;
+    }
+
+    for (int ii = 0; ii < REALLOC_BUFS; ++ii) {
+        xfree(bufs[ii]);
+    }
+}
+
+// Replay of the size mix from frag_main.c's next_size(): each round
+// allocates 512 blocks, sized like small_chunks() does, then frees them.
+
+static
+long
+isqrt(long xx)
+{
+    long rr = 0;
+    while ((rr + 1) * (rr + 1) <= xx) {
+        rr++;
+    }
+    return rr;
+}
+
+static
+long
+next_size(long* state)
+{
+    *state = (*state * 4091 + 1697) % 65537;
+    switch (*state % 3) {
+        case 0:
+            return *state;
+        case 1:
+            return *state % 101;
+        default:
+            return isqrt(*state);
+    }
+}
+
+static
+void
+frag_replay(bench_thread* bt)
+{
+    long state = 10 + bt->id;
+    void* xs[512];
+
+    while (bt->ops < ops_per_thread) {
+        for (int ii = 0; ii < 512; ++ii) {
+            long size = next_size(&state);
+            xs[ii] = bench_alloc(bt, size > 0 ? size : 1);
+        }
+        for (int ii = 0; ii < 512; ++ii) {
+            xfree(xs[ii]);
+        }
+    }
+}
+
+typedef struct workload {
+    const char* name;
+    void (*run)(bench_thread* bt);
+} workload;
+
+static workload workloads[] = {
+    {"larson",     larson},
+    {"threadtest", threadtest},
+    {"arena",      arena_churn},
+    {"prodcons",   prodcons},
+    {"realloc",    realloc_chain},
+    {"frag",       frag_replay},
+};
+
+static workload* chosen;
+
+static
+void*
+bench_worker(void* arg)
+{
+    bench_thread* bt = arg;
+    chosen->run(bt);
+    return 0;
+}
+
+static
+int
+cmp_long(const void* aa, const void* bb)
+{
+    long xx = *(const long*)aa;
+    long yy = *(const long*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+int
+main(int argc, char* argv[])
+{
+    int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+
+    if (argc == 3 || argc == 4) {
+        for (int ii = 0; ii < nworkloads; ++ii) {
+            if (strcmp(argv[1], workloads[ii].name) == 0) {
+                chosen = &workloads[ii];
+            }
+        }
+        nthreads = atoi(argv[2]);
+        ops_per_thread = argc == 4 ? atol(argv[3]) : 100000;
+    }
+
+    if (!chosen || nthreads < 1 || nthreads > MAX_THREADS || ops_per_thread < 10000) {
+        printf("Usage:\n");
+        printf("\t%s WORKLOAD THREADS [OPS]\n", argv[0]);
+        printf("workloads:");
+        for (int ii = 0; ii < nworkloads; ++ii) {
+            printf(" %s", workloads[ii].name);
+        }
+        printf("\nOPS must be at least 10000\n");
+        return 1;
+    }
+
+    pthread_barrier_init(&round_barrier, 0, nthreads);
+
+    // room for samples from some overshoot past ops_per_thread
+    long max_samples = 2 * ops_per_thread / SAMPLE_EVERY + 1024;
+
+    pthread_t threads[MAX_THREADS];
+    bench_thread bts[MAX_THREADS];
+    for (int ii = 0; ii < nthreads; ++ii) {
+        bts[ii].id = ii;
+        bts[ii].ops = 0;
+        bts[ii].nsamples = 0;
+        bts[ii].samples = malloc(max_samples * sizeof(long));
+        bts[ii].seed = 1 + ii;
+    }
+
+    long t0 = now_ns();
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_create(&(threads[ii]), 0, bench_worker, &(bts[ii]));
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+    double secs = (now_ns() - t0) / 1e9;
+
+    long total_ops = 0;
+    long total_samples = 0;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        total_ops += bts[ii].ops;
+        total_samples += bts[ii].nsamples;
+    }
+
+    long* samples = malloc((total_samples + 1) * sizeof(long));
+    long nn = 0;
+    for (int ii = 0; ii < nthreads; ++ii) {
+        memcpy(samples + nn, bts[ii].samples, bts[ii].nsamples * sizeof(long));
+        nn += bts[ii].nsamples;
+        free(bts[ii].samples);
+    }
+    qsort(samples, nn, sizeof(long), cmp_long);
+    long p99 = nn ? samples[nn * 99 / 100] : 0;
+    free(samples);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("%-10s backend=%s threads=%-2d ops/s=%.0f p99_ns=%ld peak_rss_kb=%ld\n",
+           chosen->name, xmalloc_backend(), nthreads, total_ops / secs, p99,
+           ru.ru_maxrss);
+
+    pthread_barrier_destroy(&round_barrier);
+    return 0;
+}
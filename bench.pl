@@ -0,0 +1,92 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Time::HiRes qw(time);
+
+# Times the Collatz drivers and the alloc_bench workloads on each
+# allocator. Comparisons across backends use the programs that pick one
+# at startup, so every backend runs the same code.
+#
+#   perl bench.pl [TOP]
+
+my $top = shift // 20000;
+
+sub run_timed {
+    my ($prog, $args, $expect) = @_;
+    $expect //= qr/Max steps is at/;
+    my $t0 = time();
+    my $outp = `timeout -k 30 300 ./$prog $args`;
+    my $secs = time() - $t0;
+    unless ($outp =~ $expect) {
+        return "FAIL";
+    }
+    return sprintf("%.3f", $secs);
+}
+
+say "ivec scan loop, TOP = $top (seconds)";
+printf("%-8s %10s %10s\n", "backend", "copy", "in-place");
+for my $be (qw(sys hwx opt)) {
+    local $ENV{XMALLOC_BACKEND} = $be;
+    my $copy = run_timed("collatz-ivec", $top);
+    my $inpl = run_timed("collatz-ivec", "-i $top");
+    printf("%-8s %10s %10s\n", $be, $copy, $inpl);
+}
+
+say "";
+say "frag x10 (seconds)";
+for my $be (qw(sys hwx opt)) {
+    local $ENV{XMALLOC_BACKEND} = $be;
+    printf("%-8s %10s\n", $be, run_timed("frag", 10, qr/frag test ok/));
+}
+
+# opt_malloc.c page formats: bitmap (the default) against free list.
+say "";
+say "opt page format, TOP = $top (seconds)";
+printf("%-12s %10s %10s\n", "program", "bitmap", "free list");
+for my $prog (qw(collatz-list collatz-ivec)) {
+    my $bm = run_timed("$prog-opt", $top);
+    my $fl = run_timed("$prog-opt-fl", $top);
+    printf("%-12s %10s %10s\n", $prog, $bm, $fl);
+}
+{
+    my $bm = run_timed("frag-opt", 10, qr/frag test ok/);
+    my $fl = run_timed("frag-opt-fl", 10, qr/frag test ok/);
+    printf("%-12s %10s %10s\n", "frag x10", $bm, $fl);
+}
+
+# Allocator workloads from alloc_bench.c, across thread counts.
+my $ops = 20000;
+
+# opt arenas with and without cache line padding between them. Only a
+# machine with at least as many cores as threads can show false sharing.
+say "";
+say "opt arena padding, arena workload, $ops allocations per thread (ops/s)";
+printf("%-8s %12s %12s\n", "threads", "padded", "packed");
+for my $nt (1, 2, 4, 8) {
+    my @rates;
+    for my $prog (qw(bench-opt bench-opt-packed)) {
+        my $outp = `timeout -k 30 300 ./$prog arena $nt $ops`;
+        push @rates, $outp =~ /ops\/s=(\S+)/ ? $1 : "FAIL";
+    }
+    printf("%-8d %12s %12s\n", $nt, @rates);
+}
+
+say "";
+say "allocator workloads, $ops allocations per thread";
+printf("%-10s %-8s %7s %12s %10s %12s\n",
+       "workload", "backend", "threads", "ops/s", "p99 ns", "peak RSS KB");
+for my $wl (qw(larson threadtest arena prodcons realloc frag)) {
+    for my $be (qw(sys hwx opt)) {
+        local $ENV{XMALLOC_BACKEND} = $be;
+        for my $nt (1, 2, 4, 8) {
+            my $outp = `timeout -k 30 300 ./alloc-bench $wl $nt $ops`;
+            if ($outp =~ /ops\/s=(\S+) p99_ns=(\S+) peak_rss_kb=(\S+)/) {
+                printf("%-10s %-8s %7d %12s %10s %12s\n", $wl, $be, $nt, $1, $2, $3);
+            }
+            else {
+                printf("%-10s %-8s %7d %12s\n", $wl, $be, $nt, "FAIL");
+            }
+        }
+    }
+}
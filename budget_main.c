@@ -0,0 +1,101 @@
+// Heap budget test for opt_malloc.c.
+//
+//   budget-opt [ROUNDS]
+//
+// Sets a 1 MiB soft and 2 MiB hard limit, then for ROUNDS rounds fills
+// the budget with small blocks until xmalloc fails, frees them all, and
+// checks that blocks of every bucket size and a large block can be had
+// again. Memory given back has to be reusable by any size, not just the
+// one that freed it, and the low memory handler has to have run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "opt_malloc.h"
+
+#define SOFT (1024 * 1024)
+#define HARD (2 * 1024 * 1024)
+
+// far more than fit under the hard limit
+#define MAX_BLOCKS (HARD / 4)
+
+static long low_memory_calls = 0;
+
+static
+void
+on_low_memory(size_t mapped)
+{
+    low_memory_calls += 1;
+}
+
+// Allocate size byte blocks until xmalloc says no; returns how many.
+static
+long
+fill(void** blocks, size_t size)
+{
+    long nn = 0;
+    while (nn < MAX_BLOCKS) {
+        void* xx = xmalloc(size);
+        if (xx == 0) {
+            break;
+        }
+        memset(xx, 0x55, size);
+        blocks[nn++] = xx;
+    }
+    return nn;
+}
+
+int
+main(int argc, char* argv[])
+{
+    long rounds = argc > 1 ? atol(argv[1]) : 3;
+    if (argc > 2 || rounds < 1) {
+        printf("Usage:\n");
+        printf("\t%s [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+
+    // the block list itself stays outside the budget
+    void** blocks = malloc(MAX_BLOCKS * sizeof(void*));
+
+    xmalloc_set_limits(SOFT, HARD);
+    xmalloc_on_low_memory(on_low_memory);
+
+    static const size_t sizes[] = { 4, 16, 100, 1000, 20000 };
+    int ok = 1;
+    for (long rr = 0; rr < rounds; ++rr) {
+        size_t size = rr % 2 ? 16 : 4;
+        long nn = fill(blocks, size);
+        if (nn == MAX_BLOCKS) {
+            printf("round %ld: %zu byte blocks never ran out\n", rr, size);
+            ok = 0;
+            break;
+        }
+        xfree_batch(blocks, nn);
+        printf("round %ld: %ld blocks of %zu bytes\n", rr, nn, size);
+
+        for (int ii = 0; ii < sizeof(sizes) / sizeof(sizes[0]); ++ii) {
+            void* xx = xmalloc(sizes[ii]);
+            if (xx == 0) {
+                printf("round %ld: xmalloc(%zu) failed after the free\n",
+                       rr, sizes[ii]);
+                ok = 0;
+                continue;
+            }
+            xfree(xx);
+        }
+    }
+    free(blocks);
+
+    if (low_memory_calls == 0) {
+        printf("low memory handler never ran\n");
+        ok = 0;
+    }
+    if (!ok) {
+        printf("budget test failed\n");
+        return 1;
+    }
+    printf("budget test ok\n");
+    return 0;
+}
@@ -0,0 +1,101 @@
+
+// Throughput of the batched Collatz kernels.
+//
+// Runs every starting value in [2, TOP) to 1 with each kernel the CPU
+// supports, checks the step counts against the scalar kernel, and
+// reports steps per second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "collatz_kernel.h"
+
+static
+double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+double
+run_kernel(collatz_kernel kern, long* xs, long* steps, long nn)
+{
+    for (long ii = 0; ii < nn; ++ii) {
+        xs[ii] = ii + 2;
+        steps[ii] = 0;
+    }
+
+    double t0 = now();
+    for (long ii = 0; ii < nn; ii += COLLATZ_LANES) {
+        long mm = nn - ii < COLLATZ_LANES ? nn - ii : COLLATZ_LANES;
+        kern(xs + ii, steps + ii, mm, 1 << 30);
+    }
+    return now() - t0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    long top = 1000000;
+    if (argc == 2) {
+        top = atol(argv[1]);
+    }
+    if (argc > 2 || top < 3) {
+        printf("Usage:\n");
+        printf("\t%s [TOP]\n", argv[0]);
+        return 1;
+    }
+
+    long nn = top - 2;
+    long* xs = malloc(nn * sizeof(long));
+    long* steps = malloc(nn * sizeof(long));
+    long* expect = malloc(nn * sizeof(long));
+
+    run_kernel(collatz_advance_scalar, xs, expect, nn);
+
+    struct {
+        const char*    name;
+        collatz_kernel kern;
+        int            ok;
+    } isas[] = {
+        {"scalar", collatz_advance_scalar, 1},
+        {"avx2",   collatz_advance_avx2,   collatz_have_avx2()},
+        {"avx512", collatz_advance_avx512, collatz_have_avx512()},
+    };
+
+    int rv = 0;
+    for (int ii = 0; ii < 3; ++ii) {
+        if (!isas[ii].ok) {
+            printf("%-8s unsupported\n", isas[ii].name);
+            continue;
+        }
+
+        double secs = run_kernel(isas[ii].kern, xs, steps, nn);
+
+        long total = 0;
+        for (long jj = 0; jj < nn; ++jj) {
+            total += steps[jj];
+        }
+
+        if (memcmp(steps, expect, nn * sizeof(long)) != 0) {
+            printf("%-8s MISMATCH\n", isas[ii].name);
+            rv = 1;
+            continue;
+        }
+
+        printf("%-8s %ld steps in %.3f s: %.1f Msteps/s\n",
+               isas[ii].name, total, secs, total / secs / 1e6);
+    }
+
+    printf("dispatch picks %s\n", collatz_kernel_name());
+
+    free(xs);
+    free(steps);
+    free(expect);
+    return rv;
+}
@@ -0,0 +1,177 @@
+
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "collatz_kernel.h"
+
+void
+collatz_advance_scalar(long* xs, long* steps, long nn, int max_steps)
+{
+    for (long ii = 0; ii < nn; ++ii) {
+        long vv = xs[ii];
+        long ss = 0;
+        while (vv > 1 && ss < max_steps) {
+            if (vv % 2 == 0) {
+                vv = vv/2;
+            }
+            else {
+                vv = 3*vv + 1;
+            }
+            ss++;
+        }
+        xs[ii] = vv;
+        steps[ii] += ss;
+    }
+}
+
+#if defined(__x86_64__)
+
+// The vector kernels rely on every live value being positive, so that
+// n/2 is a logical shift and 3n+1 is (n << 1) + n + 1. Lanes that have
+// reached 1 are masked off and keep their value and step count.
+
+__attribute__((target("avx2")))
+void
+collatz_advance_avx2(long* xs, long* steps, long nn, int max_steps)
+{
+    const __m256i one = _mm256_set1_epi64x(1);
+    long ii = 0;
+
+    for (; ii + 4 <= nn; ii += 4) {
+        __m256i vv = _mm256_loadu_si256((__m256i*)(xs + ii));
+        __m256i ss = _mm256_loadu_si256((__m256i*)(steps + ii));
+
+        for (int jj = 0; jj < max_steps; ++jj) {
+            __m256i live = _mm256_cmpgt_epi64(vv, one);
+            if (_mm256_testz_si256(live, live)) {
+                break;
+            }
+
+            __m256i odd  = _mm256_cmpeq_epi64(_mm256_and_si256(vv, one), one);
+            __m256i half = _mm256_srli_epi64(vv, 1);
+            __m256i trip = _mm256_add_epi64(
+                _mm256_add_epi64(_mm256_slli_epi64(vv, 1), vv), one);
+            __m256i next = _mm256_blendv_epi8(half, trip, odd);
+
+            vv = _mm256_blendv_epi8(vv, next, live);
+            // live lanes are all ones, i.e. -1
+            ss = _mm256_sub_epi64(ss, live);
+        }
+
+        _mm256_storeu_si256((__m256i*)(xs + ii), vv);
+        _mm256_storeu_si256((__m256i*)(steps + ii), ss);
+    }
+
+    collatz_advance_scalar(xs + ii, steps + ii, nn - ii, max_steps);
+}
+
+__attribute__((target("avx512f")))
+void
+collatz_advance_avx512(long* xs, long* steps, long nn, int max_steps)
+{
+    const __m512i one = _mm512_set1_epi64(1);
+    long ii = 0;
+
+    for (; ii + 8 <= nn; ii += 8) {
+        __m512i vv = _mm512_loadu_si512(xs + ii);
+        __m512i ss = _mm512_loadu_si512(steps + ii);
+
+        for (int jj = 0; jj < max_steps; ++jj) {
+            __mmask8 live = _mm512_cmpgt_epi64_mask(vv, one);
+            if (live == 0) {
+                break;
+            }
+
+            __mmask8 odd  = _mm512_test_epi64_mask(vv, one);
+            __m512i  half = _mm512_srli_epi64(vv, 1);
+            __m512i  trip = _mm512_add_epi64(
+                _mm512_add_epi64(_mm512_slli_epi64(vv, 1), vv), one);
+            __m512i  next = _mm512_mask_blend_epi64(odd, half, trip);
+
+            vv = _mm512_mask_mov_epi64(vv, live, next);
+            ss = _mm512_mask_add_epi64(ss, live, ss, one);
+        }
+
+        _mm512_storeu_si512(xs + ii, vv);
+        _mm512_storeu_si512(steps + ii, ss);
+    }
+
+    collatz_advance_avx2(xs + ii, steps + ii, nn - ii, max_steps);
+}
+
+int
+collatz_have_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+int
+collatz_have_avx512()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+
+#else
+
+void
+collatz_advance_avx2(long* xs, long* steps, long nn, int max_steps)
+{
+    collatz_advance_scalar(xs, steps, nn, max_steps);
+}
+
+void
+collatz_advance_avx512(long* xs, long* steps, long nn, int max_steps)
+{
+    collatz_advance_scalar(xs, steps, nn, max_steps);
+}
+
+int
+collatz_have_avx2()
+{
+    return 0;
+}
+
+int
+collatz_have_avx512()
+{
+    return 0;
+}
+
+#endif
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static collatz_kernel best_kernel = collatz_advance_scalar;
+static const char* best_name = "scalar";
+
+static
+void
+pick_kernel()
+{
+    if (collatz_have_avx512()) {
+        best_kernel = collatz_advance_avx512;
+        best_name = "avx512";
+    }
+    else if (collatz_have_avx2()) {
+        best_kernel = collatz_advance_avx2;
+        best_name = "avx2";
+    }
+}
+
+void
+collatz_advance(long* xs, long* steps, long nn, int max_steps)
+{
+    pthread_once(&kernel_once, pick_kernel);
+    best_kernel(xs, steps, nn, max_steps);
+}
+
+const char*
+collatz_kernel_name()
+{
+    pthread_once(&kernel_once, pick_kernel);
+    return best_name;
+}
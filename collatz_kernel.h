@@ -0,0 +1,28 @@
+#ifndef COLLATZ_KERNEL_H
+#define COLLATZ_KERNEL_H
+
+// Batched Collatz stepping.
+//
+// Each kernel advances nn independent trajectories at once. Lane ii
+// takes up to max_steps steps, stopping early once xs[ii] reaches 1,
+// and adds the number of steps taken to steps[ii]. Values must be > 0.
+//
+// The results are bit-identical to calling collatz_step one value at a time.
+
+// Widest batch any kernel handles in one go.
+#define COLLATZ_LANES 8
+
+typedef void (*collatz_kernel)(long* xs, long* steps, long nn, int max_steps);
+
+void collatz_advance_scalar(long* xs, long* steps, long nn, int max_steps);
+void collatz_advance_avx2(long* xs, long* steps, long nn, int max_steps);
+void collatz_advance_avx512(long* xs, long* steps, long nn, int max_steps);
+
+int collatz_have_avx2();
+int collatz_have_avx512();
+
+// Best kernel for this CPU, picked once at first use.
+void collatz_advance(long* xs, long* steps, long nn, int max_steps);
+const char* collatz_kernel_name();
+
+#endif
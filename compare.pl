@@ -0,0 +1,69 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Time::HiRes qw(time);
+
+# Times the same runs in each build configuration: the default debug
+# build, build/release (make release) and build/pgo (make pgo).
+#
+#   perl compare.pl [TOP]
+
+my $top = shift // 5000;
+
+my @configs = (
+    ["debug",   "."],
+    ["release", "build/release"],
+    ["pgo",     "build/pgo"],
+);
+
+my @runs = (
+    ["collatz-list-sys", $top],
+    ["collatz-list-hwx", $top],
+    ["collatz-list-opt", $top],
+    ["collatz-ivec-sys", $top],
+    ["collatz-ivec-hwx", $top],
+    ["collatz-ivec-opt", $top],
+    ["frag-sys", 1],
+    ["frag-opt", 1],
+);
+
+sub run_timed {
+    my ($dir, $prog, $args) = @_;
+    unless (-x "$dir/$prog") {
+        return "-";
+    }
+    my $t0 = time();
+    system("timeout -k 30 300 $dir/$prog $args > /dev/null");
+    my $secs = time() - $t0;
+    if ($? != 0) {
+        return "FAIL";
+    }
+    return sprintf("%.3f", $secs);
+}
+
+say "seconds per run, TOP = $top";
+printf("%-20s", "run");
+for my $cfg (@configs) {
+    printf(" %10s", $cfg->[0]);
+}
+printf(" %10s\n", "debug/pgo");
+
+for my $run (@runs) {
+    my ($prog, $args) = @$run;
+    printf("%-20s", $prog);
+
+    my @times;
+    for my $cfg (@configs) {
+        my $tt = run_timed($cfg->[1], $prog, $args);
+        push @times, $tt;
+        printf(" %10s", $tt);
+    }
+
+    if ($times[0] =~ /^[\d.]+$/ && $times[2] =~ /^[\d.]+$/ && $times[2] > 0) {
+        printf(" %9.2fx\n", $times[0] / $times[2]);
+    }
+    else {
+        printf(" %10s\n", "-");
+    }
+}
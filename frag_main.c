@@ -1,6 +1,21 @@
 
+// Fragmentation test and benchmark.
+//
+//   frag-opt [ITERS [SEED [LIMIT_MB]]]
+//
+// Runs ITERS rounds of the small_chunks/big_chunk pattern under a 16 MiB
+// (or LIMIT_MB) RLIMIT_AS, reporting how much memory the process has
+// mapped and resident against how much the test really holds. It also
+// lowers the limit step by step and counts how many allocations succeed
+// at each; running out has to end in xmalloc returning 0, not a crash.
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 
@@ -54,52 +69,225 @@ next_size()
     }
 }
 
+// Memory use of the whole process, from /proc/self/statm.
+typedef struct mem_use {
+    long mapped;
+    long resident;
+} mem_use;
+
+mem_use base_use;
+
+mem_use
+read_statm()
+{
+    mem_use mu = {0, 0};
+    char buf[128];
+
+    // no stdio here, so measuring doesn't allocate
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) {
+        return mu;
+    }
+    ssize_t nn = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nn <= 0) {
+        return mu;
+    }
+    buf[nn] = 0;
+
+    long page = sysconf(_SC_PAGESIZE);
+    sscanf(buf, "%ld %ld", &mu.mapped, &mu.resident);
+    mu.mapped *= page;
+    mu.resident *= page;
+    return mu;
+}
+
+// Print how much memory the process has beyond what it had at startup,
+// next to the bytes the test currently holds.
+void
+report(const char* phase, int round, long live)
+{
+    mem_use mu = read_statm();
+    long mapped = mu.mapped - base_use.mapped;
+    long resident = mu.resident - base_use.resident;
+
+    printf("%-6s %3d %10ld %10ld %10ld %8.3f\n", phase, round,
+           live / 1024, resident / 1024, mapped / 1024,
+           mapped > 0 ? (double)live / mapped : 0.0);
+}
+
+// The test can't go on without its memory, but say so instead of
+// crashing on the null pointer.
+void*
+xmalloc_or_die(long size)
+{
+    void* xx = xmalloc(size);
+    if (xx == 0) {
+        printf("xmalloc(%ld) failed\n", size);
+        exit(1);
+    }
+    return xx;
+}
+
 void
-small_chunks()
+small_chunks(int round)
 {
     long sum = 0;
+    long live = 512 * sizeof(char*);
 
-    char** xs = xmalloc(512 * sizeof(char*));
+    char** xs = xmalloc_or_die(512 * sizeof(char*));
     for (int ii = 0; ii < 512; ++ii) {
         long size = next_size();
         sum += size;
         if (sum < SIZE) {
-            xs[ii] = xmalloc(size);
+            xs[ii] = xmalloc_or_die(size);
             memset(xs[ii], 0x99, size);
+            live += size;
         }
         else {
             xs[ii] = 0;
         }
     }
+    report("small", round, live);
+
     for (int ii = 0; ii < 512; ++ii) {
         if (xs[ii]) {
             xfree(xs[ii]);
         }
     }
     xfree(xs);
+    report("freed", round, 0);
 }
 
+// The big block comes from xcalloc, so a backend that hands out fresh
+// pages doesn't need to touch them; the rss column shows whether it did.
 void
-big_chunk()
+big_chunk(int round)
 {
-    char* big = xmalloc(SIZE);
-    memset(big, 99, SIZE);
+    char* big = xcalloc(1, SIZE);
+    if (big == 0) {
+        printf("xcalloc(%d) failed\n", SIZE);
+        exit(1);
+    }
+    for (long ii = 0; ii < SIZE; ii += 4096) {
+        if (big[ii] != 0) {
+            printf("xcalloc block not zeroed at %ld\n", ii);
+            exit(1);
+        }
+    }
+    report("big", round, SIZE);
+
     xfree(big);
+    report("freed", round, 0);
 }
 
+// Count how many next_size() allocations succeed before xmalloc fails
+// with the address space capped at limit. Runs in a child, since a
+// backend may crash rather than fail cleanly; the count so far is kept
+// in shared memory so it survives that. The parent mustn't have touched
+// the heap yet, or the child would start out with its free memory.
 int
-main(int _ac, char* _av[])
+probe_limit(long limit, long* count)
 {
+    *count = 0;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        struct rlimit lim;
+        getrlimit(RLIMIT_AS, &lim);
+        lim.rlim_cur = limit;
+        setrlimit(RLIMIT_AS, &lim);
+
+        for (;;) {
+            long size = next_size();
+            char* xx = xmalloc(size);
+            if (xx == 0) {
+                _exit(0);
+            }
+            memset(xx, 0x99, size);
+            *count += 1;
+        }
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return !WIFSIGNALED(status);
+}
+
+int
+main(int argc, char* argv[])
+{
+    long iters = 1;
+    long limit_top = LIMIT;
+    if (argc > 1) {
+        iters = atol(argv[1]);
+    }
+    if (argc > 2) {
+        state = atol(argv[2]);
+    }
+    if (argc > 3) {
+        limit_top = atol(argv[3]) * 1024 * 1024;
+    }
+    if (argc > 4 || iters < 1 || limit_top < 4 * 1024 * 1024) {
+        printf("Usage:\n");
+        printf("\t%s [ITERS [SEED [LIMIT_MB]]]\n", argv[0]);
+        return 1;
+    }
+
     struct rlimit lim;
-    lim.rlim_cur = LIMIT;
-    lim.rlim_max = LIMIT;
+    lim.rlim_cur = limit_top;
+    lim.rlim_max = limit_top;
     setrlimit(RLIMIT_AS, &lim);
 
-    small_chunks();
-    big_chunk();
-    small_chunks();
-    big_chunk();
+    // The limit probes go first, before anything here calls xmalloc or
+    // stdio, and their table is printed at the end.
+    long nlimits = (limit_top - 4 * 1024 * 1024) / (2 * 1024 * 1024) + 1;
+    long* counts = mmap(0, nlimits * sizeof(long), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counts == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    int crashed[nlimits];
+    for (long ii = 0; ii < nlimits; ++ii) {
+        crashed[ii] = !probe_limit(limit_top - ii * 2 * 1024 * 1024, &(counts[ii]));
+    }
+
+    // deltas are against what the process uses before the first xmalloc
+    base_use = read_statm();
 
+    printf("backend %s\n", xmalloc_backend());
+    printf("%-6s %3s %10s %10s %10s %8s\n",
+           "phase", "#", "live KB", "rss KB", "mapped KB", "live/map");
+    for (long ii = 0; ii < iters; ++ii) {
+        small_chunks(2 * ii);
+        big_chunk(2 * ii);
+        small_chunks(2 * ii + 1);
+        big_chunk(2 * ii + 1);
+    }
+
+    // ru_maxrss is the high-water mark, including any spike between
+    // two reports
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    mem_use steady = read_statm();
+    printf("peak rss %ld KB, steady-state rss %ld KB\n",
+           usage.ru_maxrss - base_use.resident / 1024,
+           (steady.resident - base_use.resident) / 1024);
+
+    printf("%8s %10s\n", "limit MB", "allocs");
+    int clean = 1;
+    for (long ii = 0; ii < nlimits; ++ii) {
+        printf("%8ld %10ld%s\n", (limit_top - ii * 2 * 1024 * 1024) / (1024 * 1024),
+               counts[ii], crashed[ii] ? " (crashed)" : "");
+        clean &= !crashed[ii];
+    }
+    munmap(counts, nlimits * sizeof(long));
+
+    if (!clean) {
+        printf("frag test failed: crashed out of memory\n");
+        return 1;
+    }
     printf("frag test ok\n");
 
     return 0;
@@ -0,0 +1,100 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+no warnings 'portable';
+
+# Turns a heap profile from heapprof_malloc.c into folded stacks, one
+# "outer;...;inner bytes" line per call stack, for flamegraph.pl or just
+# sort -k2 -n. Sample counts are scaled back up the same way pprof does.
+#
+#   perl heapprof.pl PROGRAM PROFILE [inuse|alloc]
+
+my ($prog, $path, $which) = @ARGV;
+$which //= "inuse";
+unless ($prog && $path && $which =~ /^(inuse|alloc)$/) {
+    say "Usage:";
+    say "\tperl heapprof.pl PROGRAM PROFILE [inuse|alloc]";
+    exit(1);
+}
+
+open(my $fh, "<", $path) or die "$path: $!";
+
+my $rate;
+my @stacks;
+my @maps;
+my $in_maps = 0;
+while (my $line = <$fh>) {
+    if ($line =~ /^heap profile:.*heap_v2\/(\d+)/) {
+        $rate = $1;
+    }
+    elsif ($line =~ /^MAPPED_LIBRARIES:/) {
+        $in_maps = 1;
+    }
+    elsif ($in_maps) {
+        # start-end perms offset dev inode path
+        if ($line =~ /^([0-9a-f]+)-([0-9a-f]+) \S+ ([0-9a-f]+) \S+ \S+\s+(\S+)/) {
+            push @maps, [hex($1), hex($2), hex($3), $4];
+        }
+    }
+    elsif ($line =~ /^(\d+): (\d+) \[(\d+): (\d+)\] @ (.*)/) {
+        my ($count, $bytes) = $which eq "inuse" ? ($1, $2) : ($3, $4);
+        next if $count == 0;
+        push @stacks, [$count, $bytes, [map { hex($_) } split(' ', $5)]];
+    }
+}
+close($fh);
+die "$path: not a heap profile\n" unless $rate;
+
+# Return addresses point after the call, so look up the byte before. Only
+# frames in PROGRAM get names; the rest are left as addresses.
+my ($prog_name) = $prog =~ m{([^/]+)$};
+my %names;
+my @want;
+for my $st (@stacks) {
+    for my $pc (@{$st->[2]}) {
+        next if exists $names{$pc};
+        $names{$pc} = sprintf("0x%x", $pc);
+        for my $mm (@maps) {
+            my ($lo, $hi, $off, $file) = @$mm;
+            if ($pc >= $lo && $pc < $hi && $file =~ m{/\Q$prog_name\E$}) {
+                push @want, [$pc, $pc - 1 - $lo + $off];
+                last;
+            }
+        }
+    }
+}
+
+if (@want) {
+    my $addrs = join(" ", map { sprintf("0x%x", $_->[1]) } @want);
+    my @out = `addr2line -a -f -i -e $prog $addrs`;
+    my %by_addr;
+    my $cur;
+    while (@out) {
+        my $line = shift(@out);
+        chomp $line;
+        if ($line =~ /^0x([0-9a-f]+)$/) {
+            $cur = hex($1);
+            $by_addr{$cur} = [];
+            next;
+        }
+        # function name, then file:line; inlined frames come innermost first
+        shift(@out);
+        push @{$by_addr{$cur}}, $line;
+    }
+    for my $ww (@want) {
+        my $fns = $by_addr{$ww->[1]};
+        $names{$ww->[0]} = join(";", reverse(@$fns)) if $fns && @$fns;
+    }
+}
+
+my %folded;
+for my $st (@stacks) {
+    my ($count, $bytes, $pcs) = @$st;
+    my $scale = 1 / (1 - exp(-($bytes / $count) / $rate));
+    my $key = join(";", map { $names{$_} } reverse(@$pcs));
+    $folded{$key} += $bytes * $scale;
+}
+
+for my $key (sort { $folded{$b} <=> $folded{$a} } keys %folded) {
+    printf("%s %.0f\n", $key, $folded{$key});
+}
@@ -0,0 +1,509 @@
+
+// Sampling heap profiler.
+//
+// Provides the xmalloc API on top of a renamed backend, like
+// trace_malloc.c. On average one allocation per $XMALLOC_PROF_RATE bytes
+// (512 KiB by default) is sampled: the gaps between samples are drawn
+// from an exponential distribution, so big allocations are more likely
+// to be picked but every byte has the same chance. A sampled allocation
+// records its call stack and stays tracked until it is freed.
+//
+// The profile is written in the legacy text format pprof reads for heap
+// profiles, to $XMALLOC_PROF (xmalloc.prof by default) at exit, and to
+// $XMALLOC_PROF.N on each SIGUSR2. Counts are raw samples; pprof scales
+// them up using the rate in the header. heapprof.pl turns a profile into
+// folded stacks.
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "xmalloc.h"
+
+void* backend_xmalloc(size_t bytes);
+void  backend_xfree(void* ptr);
+void  backend_xfree_batch(void** ptrs, size_t nn);
+void* backend_xrealloc(void* prev, size_t bytes);
+void* backend_xcalloc(size_t nn, size_t size);
+const char* backend_xmalloc_backend();
+
+#define PROF_MAX_DEPTH 32
+
+// distinct stacks kept, a power of two
+#define PROF_STACKS 4096
+
+// live sampled blocks are tracked in this many shards of this many slots
+#define LIVE_SHARDS 64
+#define LIVE_SLOTS  1024
+
+// Counts of live sampled blocks by the top bits of their hash. A free
+// whose count is zero can't be sampled and skips the shard lock, so only
+// the few frees that share a count with a sampled block pay for a lookup.
+#define LIVE_MARK_BITS 16
+
+typedef struct prof_stack {
+    uint64_t hash;
+    int      depth;
+    void*    pcs[PROF_MAX_DEPTH];
+    long     live_count;
+    long     live_bytes;
+    long     alloc_count;
+    long     alloc_bytes;
+} prof_stack;
+
+typedef struct live_slot {
+    uintptr_t ptr;
+    int       stack;
+    uint32_t  size;
+} live_slot;
+
+typedef struct live_shard {
+    pthread_mutex_t mutex;
+    live_slot       slots[LIVE_SLOTS];
+} live_shard;
+
+static pthread_once_t prof_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static prof_stack* stacks;
+static live_shard* live;
+static long sample_rate = 512 * 1024;
+static const char* prof_path;
+
+static uint32_t live_marks[1 << LIVE_MARK_BITS];
+static volatile sig_atomic_t dump_requested = 0;
+static int dump_seq = 0;
+
+static __thread long bytes_until_sample = 0;
+static __thread uint64_t rng = 0;
+
+static
+uint64_t
+mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// bytes to the next sample, exponential with mean sample_rate
+static
+long
+next_interval()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    double uu = (rng >> 11) * (1.0 / 9007199254740992.0);
+    return (long)(-log(1.0 - uu) * sample_rate) + 1;
+}
+
+static
+void
+write_all(int fd, const char* data, long len)
+{
+    while (len > 0) {
+        ssize_t nn = write(fd, data, len);
+        if (nn <= 0) {
+            return;
+        }
+        data += nn;
+        len -= nn;
+    }
+}
+
+static
+void
+dump_profile(const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+
+    char line[64 + 20 * PROF_MAX_DEPTH];
+    pthread_mutex_lock(&stack_mutex);
+
+    long totals[4] = {0, 0, 0, 0};
+    for (int ii = 0; ii < PROF_STACKS; ++ii) {
+        prof_stack* st = &(stacks[ii]);
+        totals[0] += st->live_count;
+        totals[1] += st->live_bytes;
+        totals[2] += st->alloc_count;
+        totals[3] += st->alloc_bytes;
+    }
+
+    int nn = snprintf(line, sizeof(line),
+                      "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%ld\n",
+                      totals[0], totals[1], totals[2], totals[3], sample_rate);
+    write_all(fd, line, nn);
+
+    for (int ii = 0; ii < PROF_STACKS; ++ii) {
+        prof_stack* st = &(stacks[ii]);
+        if (st->depth == 0) {
+            continue;
+        }
+
+        nn = snprintf(line, sizeof(line), "%ld: %ld [%ld: %ld] @",
+                      st->live_count, st->live_bytes,
+                      st->alloc_count, st->alloc_bytes);
+        for (int jj = 0; jj < st->depth; ++jj) {
+            nn += snprintf(line + nn, sizeof(line) - nn, " %p", st->pcs[jj]);
+        }
+        line[nn++] = '\n';
+        write_all(fd, line, nn);
+    }
+
+    pthread_mutex_unlock(&stack_mutex);
+
+    // lets pprof map addresses back to the binary and libraries
+    const char* hdr = "\nMAPPED_LIBRARIES:\n";
+    write_all(fd, hdr, 19);
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char buf[4096];
+        ssize_t got;
+        while ((got = read(maps, buf, sizeof(buf))) > 0) {
+            write_all(fd, buf, got);
+        }
+        close(maps);
+    }
+
+    close(fd);
+}
+
+static
+void
+dump_at_exit()
+{
+    dump_profile(prof_path);
+}
+
+// Dumping takes locks, so the handler only asks for it and the next
+// xmalloc call does it.
+static
+void
+on_sigusr2(int sig)
+{
+    dump_requested = 1;
+}
+
+static
+void
+prof_init()
+{
+    const char* rate = getenv("XMALLOC_PROF_RATE");
+    if (rate && atol(rate) > 0) {
+        sample_rate = atol(rate);
+    }
+
+    prof_path = getenv("XMALLOC_PROF");
+    if (!prof_path) {
+        prof_path = "xmalloc.prof";
+    }
+
+    stacks = mmap(0, PROF_STACKS * sizeof(prof_stack), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    live = mmap(0, LIVE_SHARDS * sizeof(live_shard), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stacks == MAP_FAILED || live == MAP_FAILED) {
+        perror("xmalloc profiler");
+        abort();
+    }
+    for (int ii = 0; ii < LIVE_SHARDS; ++ii) {
+        pthread_mutex_init(&(live[ii].mutex), 0);
+    }
+
+    struct sigaction sa;
+    sa.sa_handler = on_sigusr2;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, 0);
+
+    atexit(dump_at_exit);
+}
+
+static
+uint64_t
+hash_ptr(uintptr_t ptr)
+{
+    return (ptr >> 4) * 0x9E3779B97F4A7C15UL;
+}
+
+// Find or add the stack, returning its index or -1 if the table is full.
+// Called with stack_mutex held.
+static
+int
+intern_stack(void** pcs, int depth)
+{
+    uint64_t hash = 1469598103934665603UL;
+    for (int ii = 0; ii < depth; ++ii) {
+        hash = (hash ^ (uintptr_t)pcs[ii]) * 1099511628211UL;
+    }
+
+    for (int probe = 0; probe < PROF_STACKS; ++probe) {
+        int idx = (hash + probe) & (PROF_STACKS - 1);
+        prof_stack* st = &(stacks[idx]);
+
+        if (st->depth == 0) {
+            st->hash = hash;
+            st->depth = depth;
+            for (int ii = 0; ii < depth; ++ii) {
+                st->pcs[ii] = pcs[ii];
+            }
+            return idx;
+        }
+
+        if (st->hash == hash && st->depth == depth) {
+            int same = 1;
+            for (int ii = 0; ii < depth && same; ++ii) {
+                same = st->pcs[ii] == pcs[ii];
+            }
+            if (same) {
+                return idx;
+            }
+        }
+    }
+    return -1;
+}
+
+static inline
+uint32_t*
+live_mark(uint64_t hh)
+{
+    return &(live_marks[hh >> (64 - LIVE_MARK_BITS)]);
+}
+
+// Start tracking a sampled block. Returns 0 if its shard is full, in
+// which case the block is never counted as live.
+static
+int
+track_live(void* ptr, int stack, size_t size)
+{
+    uint64_t hh = hash_ptr((uintptr_t)ptr);
+    live_shard* sh = &(live[hh % LIVE_SHARDS]);
+    int tracked = 0;
+
+    pthread_mutex_lock(&(sh->mutex));
+    long slot = (hh / LIVE_SHARDS) & (LIVE_SLOTS - 1);
+    for (int probe = 0; probe < LIVE_SLOTS; ++probe) {
+        live_slot* ls = &(sh->slots[(slot + probe) & (LIVE_SLOTS - 1)]);
+        if (ls->ptr == 0) {
+            ls->ptr = (uintptr_t)ptr;
+            ls->stack = stack;
+            ls->size = size;
+            __atomic_fetch_add(live_mark(hh), 1, __ATOMIC_RELAXED);
+            tracked = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&(sh->mutex));
+    return tracked;
+}
+
+// Stop tracking ptr. Returns 0 if it wasn't sampled, else 1 with the
+// stack and size it was sampled with.
+static
+int
+untrack_live(void* ptr, int* stack, size_t* size)
+{
+    uint64_t hh = hash_ptr((uintptr_t)ptr);
+    if (__atomic_load_n(live_mark(hh), __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    live_shard* sh = &(live[hh % LIVE_SHARDS]);
+    int found = 0;
+
+    pthread_mutex_lock(&(sh->mutex));
+    long ii = (hh / LIVE_SHARDS) & (LIVE_SLOTS - 1);
+    for (int probe = 0; probe < LIVE_SLOTS; ++probe) {
+        live_slot* ls = &(sh->slots[ii]);
+        if (ls->ptr == 0) {
+            break;
+        }
+        if (ls->ptr == (uintptr_t)ptr) {
+            *stack = ls->stack;
+            *size = ls->size;
+            found = 1;
+
+            // backward-shift delete, as in trace_replay.c
+            ls->ptr = 0;
+            long jj = ii;
+            for (;;) {
+                jj = (jj + 1) & (LIVE_SLOTS - 1);
+                live_slot* next = &(sh->slots[jj]);
+                if (next->ptr == 0) {
+                    break;
+                }
+                long home = (hash_ptr(next->ptr) / LIVE_SHARDS) & (LIVE_SLOTS - 1);
+                if (ii <= jj ? (ii < home && home <= jj) : (ii < home || home <= jj)) {
+                    continue;
+                }
+                sh->slots[ii] = *next;
+                next->ptr = 0;
+                ii = jj;
+            }
+            __atomic_fetch_sub(live_mark(hh), 1, __ATOMIC_RELAXED);
+            break;
+        }
+        ii = (ii + 1) & (LIVE_SLOTS - 1);
+    }
+    pthread_mutex_unlock(&(sh->mutex));
+    return found;
+}
+
+// take a block that is no longer live off its stack's live totals
+static
+void
+uncharge_live(int stack, size_t size)
+{
+    pthread_mutex_lock(&stack_mutex);
+    stacks[stack].live_count -= 1;
+    stacks[stack].live_bytes -= size;
+    pthread_mutex_unlock(&stack_mutex);
+}
+
+// Stop tracking ptr if it was sampled, and take it off its stack's live
+// totals.
+static
+void
+forget_live(void* ptr)
+{
+    int stack;
+    size_t size;
+    if (untrack_live(ptr, &stack, &size)) {
+        uncharge_live(stack, size);
+    }
+}
+
+// Kept out of line so the frames it skips are always the same two: this
+// function and the xmalloc entry point that called it.
+static __attribute__((noinline))
+void
+record_sample(void* ptr, size_t bytes)
+{
+    void* pcs[PROF_MAX_DEPTH + 2];
+    int depth = backtrace(pcs, PROF_MAX_DEPTH + 2) - 2;
+    if (depth <= 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&stack_mutex);
+    int stack = intern_stack(pcs + 2, depth);
+    if (stack >= 0) {
+        stacks[stack].alloc_count += 1;
+        stacks[stack].alloc_bytes += bytes;
+    }
+    pthread_mutex_unlock(&stack_mutex);
+
+    // live only once it is tracked, so that its free uncharges it; nobody
+    // can free ptr before we return it
+    if (stack >= 0 && track_live(ptr, stack, bytes)) {
+        pthread_mutex_lock(&stack_mutex);
+        stacks[stack].live_count += 1;
+        stacks[stack].live_bytes += bytes;
+        pthread_mutex_unlock(&stack_mutex);
+    }
+}
+
+static inline
+int
+should_sample(size_t bytes)
+{
+    pthread_once(&prof_once, prof_init);
+
+    if (dump_requested) {
+        dump_requested = 0;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s.%d", prof_path,
+                 __atomic_fetch_add(&dump_seq, 1, __ATOMIC_RELAXED));
+        dump_profile(path);
+    }
+
+    bytes_until_sample -= bytes;
+    if (bytes_until_sample > 0) {
+        return 0;
+    }
+
+    // a thread's first call only starts its countdown
+    if (rng == 0) {
+        rng = mono_ns() ^ (uintptr_t)&rng;
+        bytes_until_sample = next_interval() - bytes;
+        if (bytes_until_sample > 0) {
+            return 0;
+        }
+    }
+
+    bytes_until_sample = next_interval();
+    return 1;
+}
+
+void*
+xmalloc(size_t bytes)
+{
+    void* ptr = backend_xmalloc(bytes);
+    if (should_sample(bytes) && ptr) {
+        record_sample(ptr, bytes);
+    }
+    return ptr;
+}
+
+void
+xfree(void* ptr)
+{
+    forget_live(ptr);
+    backend_xfree(ptr);
+}
+
+void
+xfree_batch(void** ptrs, size_t nn)
+{
+    for (size_t ii = 0; ii < nn; ++ii) {
+        forget_live(ptrs[ii]);
+    }
+    backend_xfree_batch(ptrs, nn);
+}
+
+// prev is untracked before the call, since once the backend has freed it
+// another thread can get its address back and have that sampled. If the
+// call fails, prev is still live and goes back in the table.
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    int stack;
+    size_t size;
+    int sampled = untrack_live(prev, &stack, &size);
+    void* ptr = backend_xrealloc(prev, bytes);
+    if (sampled && (ptr != 0 || !track_live(prev, stack, size))) {
+        uncharge_live(stack, size);
+    }
+    if (should_sample(bytes) && ptr) {
+        record_sample(ptr, bytes);
+    }
+    return ptr;
+}
+
+void*
+xcalloc(size_t nn, size_t size)
+{
+    void* ptr = backend_xcalloc(nn, size);
+    if (should_sample(nn * size) && ptr) {
+        record_sample(ptr, nn * size);
+    }
+    return ptr;
+}
+
+const char*
+xmalloc_backend()
+{
+    return backend_xmalloc_backend();
+}
@@ -33,7 +33,38 @@ static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static Header base;
 static Header *freep;
 
-static void
+// The heap lives in regions: address space reserved with PROT_NONE and
+// committed from the front as the heap grows. Consecutive grows are then
+// adjacent, so their blocks coalesce on the free list. Both the commit
+// step and the size of the next reservation double on each use.
+//
+// The last page of a region is never committed, so blocks can't merge
+// across regions, and a region whose whole committed part is one free
+// block can be handed back with munmap.
+
+#define PAGE 4096
+#define MIN_COMMIT (4096 * sizeof(Header))
+#define MAX_COMMIT (4 << 20)
+#define MIN_RESERVE (1 << 20)
+#define MAX_RESERVE (64 << 20)
+#define MIN_REGIONS (PAGE / sizeof(Region))
+
+typedef struct region
+{
+  char *base;
+  size_t reserved;  // including the guard page
+  size_t committed;
+} Region;
+
+// mapped directly, and doubled when it fills up
+static Region *regions;
+static int nregions;
+static int max_regions;
+static int cur = -1;  // region that grows are committed from
+static size_t next_commit = MIN_COMMIT;
+static size_t next_reserve = MIN_RESERVE;
+
+static Header *
 xfree_helper(void *ap)
 {
   Header *bp, *p;
@@ -55,36 +86,209 @@ xfree_helper(void *ap)
     p->s.ptr = bp->s.ptr;
   }
   else
+  {
     p->s.ptr = bp;
+    p = bp;
+  }
   freep = p;
+  return p;
+}
+
+static void
+drop_region(int i)
+{
+  munmap(regions[i].base, regions[i].reserved);
+  if (i == cur)
+    cur = -1;
+  regions[i] = regions[--nregions];
+  if (cur == nregions)
+    cur = i;
+}
+
+// If free block bp is all of a region, take it off the free list and
+// unmap the region. The region grows come from is kept unless force is
+// set, so a heap that empties and refills doesn't remap every time.
+static int
+release_region(Header *bp, int force)
+{
+  Header *prevp;
+  size_t bytes = bp->s.size * sizeof(Header);
+  int i;
+
+  if (bytes < MIN_COMMIT)
+    return 0;
+  for (i = 0; i < nregions; i++)
+  {
+    if ((char *)bp != regions[i].base || bytes != regions[i].committed)
+      continue;
+    if (i == cur && !force)
+      return 0;
+    for (prevp = bp; prevp->s.ptr != bp; prevp = prevp->s.ptr)
+      ;
+    prevp->s.ptr = bp->s.ptr;
+    freep = prevp;
+    drop_region(i);
+    return 1;
+  }
+  return 0;
+}
+
+// Unmap every region that is entirely free, to make room for a new one.
+static int
+release_free_regions(void)
+{
+  Header *p;
+  int released = 0;
+
+  if (freep == 0)
+    return 0;
+  p = freep;
+  do
+  {
+    if (release_region(p->s.ptr, 1))
+    {
+      released = 1;
+      p = freep;
+    }
+    else
+      p = p->s.ptr;
+  } while (p != freep);
+  return released;
 }
 
 void xfree(void *ap)
 {
   pthread_mutex_lock(&lock);
-  xfree_helper(ap);
+  release_region(xfree_helper(ap), 0);
   pthread_mutex_unlock(&lock);
 }
 
-static Header *
-morecore(size_t nu)
+// there's only the one lock, so the whole batch goes under it
+void
+xfree_batch(void **ptrs, size_t nn)
+{
+  size_t i;
+
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < nn; i++)
+    release_region(xfree_helper(ptrs[i]), 0);
+  pthread_mutex_unlock(&lock);
+}
+
+// Double the region table, or return 0 if that can't be mapped.
+static int
+grow_regions(void)
 {
+  Region *bigger;
+  int count = max_regions ? 2 * max_regions : MIN_REGIONS;
+
+  bigger = mmap(0, count * sizeof(Region), PROT_READ | PROT_WRITE,
+                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (bigger == MAP_FAILED)
+    return 0;
+  if (regions)
+  {
+    memcpy(bigger, regions, nregions * sizeof(Region));
+    munmap(regions, max_regions * sizeof(Region));
+  }
+  regions = bigger;
+  max_regions = count;
+  return 1;
+}
+
+// Reserve a new region with room to commit at least bytes, and make it
+// the one grows come from.
+static Region *
+new_region(size_t bytes)
+{
+  Region *r;
   char *p;
+  size_t size = next_reserve;
+
+  if (nregions == max_regions && !grow_regions())
+    return 0;
+  if (size < bytes + PAGE)
+    size = bytes + PAGE;
+  p = mmap(0, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+           -1, 0);
+  if (p == MAP_FAILED && size > bytes + PAGE)
+  {
+    // short on address space, so take only what's needed
+    size = bytes + PAGE;
+    p = mmap(0, size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+             -1, 0);
+  }
+  if (p == MAP_FAILED)
+    return 0;
+  if (next_reserve < MAX_RESERVE)
+    next_reserve *= 2;
+
+  // the old region won't grow any more, so give back the rest of it
+  if (cur >= 0)
+  {
+    r = &regions[cur];
+    munmap(r->base + r->committed + PAGE, r->reserved - r->committed - PAGE);
+    r->reserved = r->committed + PAGE;
+  }
+
+  cur = nregions++;
+  r = &regions[cur];
+  r->base = p;
+  r->reserved = size;
+  r->committed = 0;
+  return r;
+}
+
+static Header *
+grow(size_t bytes, size_t step)
+{
+  Region *r = cur < 0 ? 0 : &regions[cur];
   Header *hp;
+  size_t room;
 
-  if (nu < 4096)
-    nu = 4096;
-  // TODO: Replace sbrk use with mmap
-  p = mmap(0, nu * sizeof(Header), PROT_READ | PROT_WRITE,
-           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-  if (p == (char *)-1)
+  if (r)
+  {
+    room = r->reserved - PAGE - r->committed;
+    if (room < bytes)
+      r = 0;
+    else if (step > room)
+      step = room;
+  }
+  if (r == 0 && (r = new_region(step)) == 0)
     return 0;
-  hp = (Header *)p;
-  hp->s.size = nu;
+
+  hp = (Header *)(r->base + r->committed);
+  if (mprotect(hp, step, PROT_READ | PROT_WRITE) != 0)
+  {
+    if (r->committed == 0)
+      drop_region(cur);
+    return 0;
+  }
+  r->committed += step;
+  hp->s.size = step / sizeof(Header);
   xfree_helper((void *)(hp + 1));
   return freep;
 }
 
+static Header *
+morecore(size_t nu)
+{
+  Header *hp;
+  size_t bytes = (nu * sizeof(Header) + PAGE - 1) & ~(size_t)(PAGE - 1);
+  size_t step = bytes < next_commit ? next_commit : bytes;
+
+  hp = grow(bytes, step);
+  if (hp == 0 && release_free_regions())
+    hp = grow(bytes, step);
+  if (hp == 0 && step > bytes)
+    hp = grow(bytes, bytes);
+  if (hp == 0)
+    return 0;
+  if (next_commit < MAX_COMMIT)
+    next_commit *= 2;
+  return hp;
+}
+
 void *
 xmalloc(size_t nbytes)
 {
@@ -129,11 +333,33 @@ void *
 xrealloc(void *prev, size_t nn)
 {
   void *new_block = xmalloc(nn);
+  if (new_block == 0)
+    return 0;  // prev stays as it was
+  size_t old_size = (((Header *)prev - 1)->s.size - 1) * sizeof(Header);
   
   pthread_mutex_lock(&lock);
-  memcpy(new_block, prev, nn);
-  xfree_helper(prev);
+  memcpy(new_block, prev, old_size < nn ? old_size : nn);
+  release_region(xfree_helper(prev), 0);
   pthread_mutex_unlock(&lock);
   return new_block;
 }
 
+void *
+xcalloc(size_t nn, size_t size)
+{
+  size_t nbytes;
+  if (__builtin_mul_overflow(nn, size, &nbytes))
+    return 0;
+
+  // blocks may come back off the free list, so always clear them
+  void *p = xmalloc(nbytes);
+  if (p)
+    memset(p, 0, nbytes);
+  return p;
+}
+
+const char *
+xmalloc_backend(void)
+{
+  return "hwx";
+}
@@ -1,14 +1,20 @@
+
 #ifndef IVEC_H
 #define IVEC_H
 
 #include <assert.h>
+#include <string.h>
 
 #include "xmalloc.h"
 
+// The header and the first cap0 elements share one allocation. Once a
+// vector outgrows that inline storage its data moves to a separate
+// block, and the inline space is left unused.
 typedef struct ivec {
     long  cap;
     long  size;
     long* data;
+    long  small[];
 } ivec;
 
 static
@@ -17,10 +23,13 @@ make_ivec(int cap0)
 {
     assert(cap0 > 0);
 
-    ivec* xs = xmalloc(sizeof(ivec));
+    ivec* xs = xmalloc(sizeof(ivec) + cap0 * sizeof(long));
+    if (xs == 0) {
+        return 0;
+    }
     xs->cap  = cap0;
     xs->size = 0;
-    xs->data = xmalloc(xs->cap * sizeof(long));
+    xs->data = xs->small;
     return xs;
 }
 
@@ -28,21 +37,53 @@ static
 void
 free_ivec(ivec* xs)
 {
-    xfree(xs->data);
+    if (xs->data != xs->small) {
+        xfree(xs->data);
+    }
     xfree(xs);
 }
 
+// Make sure xs can hold at least cap items without another allocation.
+// Returns 0, with xs left as it was, if there's no memory for that.
 static
-void
+int
+ivec_reserve(ivec* xs, long cap)
+{
+    if (cap <= xs->cap) {
+        return 1;
+    }
+
+    long* data;
+    if (xs->data == xs->small) {
+        data = xmalloc(cap * sizeof(long));
+        if (data) {
+            memcpy(data, xs->data, xs->size * sizeof(long));
+        }
+    }
+    else {
+        data = xrealloc(xs->data, cap * sizeof(long));
+    }
+    if (data == 0) {
+        return 0;
+    }
+
+    xs->data = data;
+    xs->cap = cap;
+    return 1;
+}
+
+// Returns 0, with xs left as it was, if xs is full and can't grow.
+static
+int
 ivec_push(ivec* xs, long item)
 {
-    if (xs->size >= xs->cap) {
-        xs->cap *= 2;
-        xs->data = xrealloc(xs->data, xs->cap * sizeof(long));
+    if (xs->size >= xs->cap && !ivec_reserve(xs, 2 * xs->cap)) {
+        return 0;
     }
 
     xs->data[xs->size] = item;
     xs->size += 1;
+    return 1;
 }
 
 static
@@ -52,14 +93,22 @@ ivec_last(ivec* xs)
     return xs->data[xs->size - 1];
 }
 
+// Copy xs into a single new allocation with room for at least cap items,
+// or return 0 if there's no memory for it.
 static
 ivec*
-ivec_copy(ivec* xs)
+ivec_copy(ivec* xs, long cap)
 {
-    ivec* ys = make_ivec(xs->cap);
-    for (long ii = 0; ii < xs->size; ++ii) {
-        ivec_push(ys, xs->data[ii]);
+    if (cap < xs->size) {
+        cap = xs->size;
+    }
+
+    ivec* ys = make_ivec(cap);
+    if (ys == 0) {
+        return 0;
     }
+    memcpy(ys->data, xs->data, xs->size * sizeof(long));
+    ys->size = xs->size;
     return ys;
 }
 
@@ -7,7 +7,14 @@
 // We'll eventually get to 1.
 
 // This program searches for the largest number of steps that
-// this takes for numbers from 2 to a provided TOP number.
+// this takes for numbers from 2 to a provided TOP number, or for
+// the numbers in [START, END). With -o it also writes every step
+// count to a file, so a huge range can be covered in segments.
+//
+// With -w the range is worked through WINDOW starting values at a time,
+// reusing the same task arrays and threads, so memory doesn't grow with
+// the range. -c FILE saves a checkpoint after each window, and --resume
+// picks the run back up from it.
 
 // To calculate this:
 //  - calculate the entire sequence for each starting value
@@ -17,24 +24,48 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <sched.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
 
 #include "xmalloc.h"
+#include "collatz_kernel.h"
 #include "ivec.h"
 
 #define THREADS 4
 
-typedef struct num_task {
-    ivec* vals;
-    long  steps;
-    int   dibs;
-    pthread_mutex_t lock;
-} num_task;
+// Task state for each starting value, kept as parallel arrays so that
+// the final reduction only streams through steps[].
+long*  steps;
+ivec** vals;
+char*  claim;
+
+// task ii is the starting value data_start + ii
+long data_start = 0;
+long data_count = 0;
+
+// the whole range; [data_start, data_start + data_count) is the current
+// window of it
+long range_start = 0;
+long range_end = 0;
+
+// -o: step counts for the range, as little-endian uint16s
+uint16_t* out_map = 0;
+
+// -w: most tasks in one window
+long window = 0;
 
-num_task** tasks;
-long data_top = 0;
+// -f: only count steps, don't keep the sequence
+int fast_mode = 0;
+
+// -i: extend the claimed vector in place instead of copying it
+int in_place = 0;
 
 long
 collatz_step(long n)
@@ -47,123 +78,461 @@ collatz_step(long n)
     }
 }
 
+// Running out, e.g. under a heap limit, ends the run; a checkpointed
+// run can be resumed from its last window.
+static
+void
+out_of_memory()
+{
+    fprintf(stderr, "ivec: out of memory\n");
+    exit(1);
+}
+
 ivec*
 iterate(ivec* xs)
 {
     long vv = 0;
     for (int jj = 0; vv != 1 && jj < 50; ++jj) {
         vv = collatz_step(ivec_last(xs));
-        ivec_push(xs, vv);
+        if (!ivec_push(xs, vv)) {
+            out_of_memory();
+        }
     }
     return xs;
 }
 
+// Take task ii for this thread; fails if another thread has it.
+static
+int
+claim_task(long ii)
+{
+    return __atomic_exchange_n(&claim[ii], 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static
+void
+release_task(long ii)
+{
+    __atomic_store_n(&claim[ii], 0, __ATOMIC_RELEASE);
+}
+
 int
 scan_and_iterate()
 {
     long done_count = 0;
-    long base = random() % data_top;
+    long base = random() % data_count;
 
-    for (long i0 = 1; i0 < data_top; ++i0) {
-        long ii = 1 + (base + i0) % (data_top - 1);
+    for (long i0 = 0; i0 < data_count; ++i0) {
+        long ii = (base + i0) % data_count;
 
-        pthread_mutex_lock(&(tasks[ii]->lock));
-        int skip = tasks[ii]->dibs;
-        if (!skip) {
-            tasks[ii]->dibs = 1;
-        }
-        pthread_mutex_unlock(&(tasks[ii]->lock));
-        if (skip) {
+        if (!claim_task(ii)) {
             continue;
         }
 
-        ivec* xs = tasks[ii]->vals;
+        ivec* xs = vals[ii];
         long vv = ivec_last(xs);
 
-        if (vv > 1) {
-            xs = ivec_copy(xs);
+        if (vv > 1 && in_place) {
+            // we hold dibs, so nobody else touches xs until we let go
+            iterate(xs);
+        }
+        else if (vv > 1) {
+            // iterate() pushes at most 50 items; make room up front
+            xs = ivec_copy(xs, xs->size + 50);
+            if (xs == 0) {
+                out_of_memory();
+            }
             xs = iterate(xs);
-            free_ivec(tasks[ii]->vals);
-            tasks[ii]->vals = xs;
+            free_ivec(vals[ii]);
+            vals[ii] = xs;
         }
         else {
-            if (tasks[ii]->steps == -1) {
-                tasks[ii]->steps = tasks[ii]->vals->size - 1;
+            if (steps[ii] == -1) {
+                steps[ii] = vals[ii]->size - 1;
             }
 
             done_count += 1;
         }
 
-        pthread_mutex_lock(&(tasks[ii]->lock));
-        tasks[ii]->dibs = 0;
-        pthread_mutex_unlock(&(tasks[ii]->lock));
+        release_task(ii);
     }
 
-    return done_count == (data_top - 1);
+    return done_count == data_count;
 }
 
-void*
-worker(void* _arg)
+// Fast mode: each task keeps only its current value, updated in place,
+// and its running step count. Claimed tasks are advanced in batches
+// with the vector kernel.
+static
+void
+iterate_batch(long* ids, long* xs, long nn)
+{
+    long ss[COLLATZ_LANES];
+    for (long kk = 0; kk < nn; ++kk) {
+        ss[kk] = steps[ids[kk]];
+    }
+
+    collatz_advance(xs, ss, nn, 50);
+
+    for (long kk = 0; kk < nn; ++kk) {
+        vals[ids[kk]]->data[0] = xs[kk];
+        steps[ids[kk]] = ss[kk];
+
+        release_task(ids[kk]);
+    }
+}
+
+int
+scan_and_iterate_fast()
 {
+    long done_count = 0;
+    long base = random() % data_count;
+
+    long ids[COLLATZ_LANES];
+    long xs[COLLATZ_LANES];
+    long nn = 0;
+
+    for (long i0 = 0; i0 < data_count; ++i0) {
+        long ii = (base + i0) % data_count;
+
+        if (!claim_task(ii)) {
+            continue;
+        }
+
+        long vv = ivec_last(vals[ii]);
+
+        if (vv > 1) {
+            ids[nn] = ii;
+            xs[nn] = vv;
+            nn++;
+            if (nn == COLLATZ_LANES) {
+                iterate_batch(ids, xs, nn);
+                nn = 0;
+            }
+            continue;
+        }
+
+        done_count += 1;
+
+        release_task(ii);
+    }
+
+    iterate_batch(ids, xs, nn);
+
+    return done_count == data_count;
+}
+
+// Each worker owns the tasks in [lo, hi) for setup, the max-steps
+// reduction and teardown. The Collatz iteration itself is shared.
+typedef struct worker_range {
+    long lo;
+    long hi;
+    long max_v;
+    long max_s;
+} worker_range;
+
+pthread_barrier_t phase_barrier;
+
+// Find the largest steps[] in [lo, hi) and the first index holding it.
+// The max loop is branch-free so the compiler can vectorize it.
+void
+max_steps_range(worker_range* rr)
+{
+    long max_s = 0;
+    for (long ii = rr->lo; ii < rr->hi; ++ii) {
+        max_s = steps[ii] > max_s ? steps[ii] : max_s;
+    }
+
+    long max_v = 0;
+    if (max_s > 0) {
+        for (long ii = rr->lo; ii < rr->hi; ++ii) {
+            if (steps[ii] == max_s) {
+                max_v = ii;
+                break;
+            }
+        }
+    }
+
+    rr->max_v = max_v;
+    rr->max_s = max_s;
+}
+
+pthread_barrier_t window_barrier;
+
+// Work through one window: the tasks in [lo, hi) are this thread's.
+static
+void
+run_window(worker_range* rr)
+{
+    for (long ii = rr->lo; ii < rr->hi; ++ii) {
+        ivec* xs = make_ivec(4);
+        if (xs == 0 || !ivec_push(xs, data_start + ii)) {
+            out_of_memory();
+        }
+        vals[ii]  = xs;
+        steps[ii] = fast_mode ? 0 : -1;
+        claim[ii] = 0;
+    }
+
+    pthread_barrier_wait(&phase_barrier);
+
+    // Tasks another thread has claimed can't be finished by anyone else,
+    // so after a pass that didn't see everything done let it run rather
+    // than spin over them. That matters most at the end of each window.
     int done = 0;
     while (!done) {
-        done = scan_and_iterate();
+        done = fast_mode ? scan_and_iterate_fast() : scan_and_iterate();
+        if (!done) {
+            sched_yield();
+        }
+    }
+
+    // other workers may still be reading our tasks on their last pass
+    pthread_barrier_wait(&phase_barrier);
+
+    max_steps_range(rr);
+
+    if (out_map) {
+        uint16_t* out = out_map + (data_start - range_start);
+        for (long ii = rr->lo; ii < rr->hi; ++ii) {
+            out[ii] = htole16(steps[ii]);
+        }
+    }
+
+    for (long ii = rr->lo; ii < rr->hi; ++ii) {
+        free_ivec(vals[ii]);
+    }
+}
+
+// Workers run one window per round, in step with main: main sets up the
+// window and meets them at window_barrier, then meets them there again
+// once they're done with it. An empty window means stop.
+void*
+worker(void* arg)
+{
+    worker_range* rr = arg;
+
+    while (1) {
+        pthread_barrier_wait(&window_barrier);
+        if (data_count == 0) {
+            break;
+        }
+
+        run_window(rr);
+
+        pthread_barrier_wait(&window_barrier);
     }
     return 0;
 }
 
+// The checkpoint is one line: the range, where the next window starts,
+// and the best so far. It goes to a temporary file that is then renamed
+// over the old one, so a crash leaves one or the other intact.
+static
+int
+save_checkpoint(const char* path, long next, long max_v, long max_s)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE* fh = fopen(tmp, "w");
+    if (!fh) {
+        return 0;
+    }
+
+    fprintf(fh, "collatz %ld %ld %ld %ld %ld\n",
+            range_start, range_end, next, max_v, max_s);
+    if (fflush(fh) != 0 || fsync(fileno(fh)) != 0) {
+        fclose(fh);
+        return 0;
+    }
+    if (fclose(fh) != 0) {
+        return 0;
+    }
+
+    return rename(tmp, path) == 0;
+}
+
+// Read a checkpoint back; it has to be for the same range.
+static
+int
+load_checkpoint(const char* path, long* next, long* max_v, long* max_s)
+{
+    FILE* fh = fopen(path, "r");
+    if (!fh) {
+        return 0;
+    }
+
+    long start = 0;
+    long end = 0;
+    int nn = fscanf(fh, "collatz %ld %ld %ld %ld %ld",
+                    &start, &end, next, max_v, max_s);
+    fclose(fh);
+
+    return nn == 5 && start == range_start && end == range_end
+        && *next >= start && *next <= end;
+}
+
 int
 main(int argc, char* argv[])
 {
     pthread_t threads[THREADS];
     int rv;
 
-    if (argc != 2) {
+    const char* out_path = 0;
+    const char* ckpt_path = 0;
+    int resume = 0;
+
+    static struct option long_opts[] = {
+        {"resume", no_argument, 0, 'r'},
+        {0, 0, 0, 0},
+    };
+
+    int opt;
+    int bad_args = 0;
+    while ((opt = getopt_long(argc, argv, "fio:w:c:", long_opts, 0)) != -1) {
+        switch (opt) {
+        case 'f':
+            fast_mode = 1;
+            break;
+        case 'i':
+            in_place = 1;
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'w':
+            window = atol(optarg);
+            bad_args |= window < 1;
+            break;
+        case 'c':
+            ckpt_path = optarg;
+            break;
+        case 'r':
+            resume = 1;
+            break;
+        default:
+            bad_args = 1;
+        }
+    }
+
+    if (optind + 1 == argc) {
+        data_start = 0;
+        data_count = atol(argv[optind]);
+    }
+    else if (optind + 2 == argc) {
+        data_start = atol(argv[optind]);
+        data_count = atol(argv[optind + 1]) - data_start;
+    }
+
+    if (bad_args || data_start < 0 || data_count < 1 || (resume && !ckpt_path)) {
         printf("Usage:\n");
-        printf("\t%s TOP\n", argv[0]);
+        printf("\t%s [-f] [-i] [-o FILE] [-w WINDOW] [-c FILE [--resume]] TOP\n", argv[0]);
+        printf("\t%s [-f] [-i] [-o FILE] [-w WINDOW] [-c FILE [--resume]] START END\n", argv[0]);
         return 1;
     }
 
-    data_top  = atol(argv[1]);
+    range_start = data_start;
+    range_end = data_start + data_count;
+    if (window == 0 || window > data_count) {
+        window = data_count;
+    }
 
-    tasks = xmalloc(data_top * sizeof(num_task*));
-    for (int ii = 0; ii < data_top; ++ii) {
-        tasks[ii] = xmalloc(sizeof(num_task));
-        ivec* xs = make_ivec(4);
-        ivec_push(xs, ii);
-        tasks[ii]->vals  = xs;
-        tasks[ii]->steps = -1;
-        tasks[ii]->dibs  = 0;
-        pthread_mutex_init(&(tasks[ii]->lock), 0);
+    long next = range_start;
+    long max_v = 0;
+    long max_s = 0;
+    if (resume && !load_checkpoint(ckpt_path, &next, &max_v, &max_s)) {
+        fprintf(stderr, "%s: no checkpoint for [%ld, %ld)\n",
+                ckpt_path, range_start, range_end);
+        return 1;
     }
 
-    for (int ii = 0; ii < THREADS; ++ii) {
-        rv = pthread_create(&(threads[ii]), 0, worker, 0);
-        assert(rv == 0);
+    int out_fd = -1;
+    size_t out_size = data_count * sizeof(uint16_t);
+    if (out_path) {
+        // a resumed run fills in the rest of the file it started
+        int trunc = resume ? 0 : O_TRUNC;
+        out_fd = open(out_path, O_RDWR | O_CREAT | trunc, 0644);
+        if (out_fd < 0 || ftruncate(out_fd, out_size) != 0) {
+            perror(out_path);
+            return 1;
+        }
+
+        out_map = mmap(0, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+        if (out_map == MAP_FAILED) {
+            perror("mmap");
+            return 1;
+        }
+    }
+
+    // one allocation backs all three task arrays, reused by every window
+    steps = xmalloc(window * (sizeof(long) + sizeof(ivec*) + sizeof(char)));
+    if (steps == 0) {
+        out_of_memory();
     }
+    vals  = (ivec**)(steps + window);
+    claim = (char*)(vals + window);
+
+    pthread_barrier_init(&phase_barrier, 0, THREADS);
+    pthread_barrier_init(&window_barrier, 0, THREADS + 1);
 
+    worker_range ranges[THREADS];
     for (int ii = 0; ii < THREADS; ++ii) {
-        rv = pthread_join(threads[ii], 0);
+        rv = pthread_create(&(threads[ii]), 0, worker, &(ranges[ii]));
         assert(rv == 0);
     }
 
-    long max_v = 0;
-    long max_s = 0;
+    while (1) {
+        data_start = next;
+        data_count = range_end - next < window ? range_end - next : window;
+        for (int ii = 0; ii < THREADS; ++ii) {
+            ranges[ii].lo = data_count * ii / THREADS;
+            ranges[ii].hi = data_count * (ii + 1) / THREADS;
+        }
 
-    for (int ii = 0; ii < data_top; ++ii) {
-        if (tasks[ii]->steps > max_s) {
-            max_v = ii;
-            max_s = tasks[ii]->steps;
+        pthread_barrier_wait(&window_barrier);
+        if (data_count == 0) {
+            break;
         }
+        pthread_barrier_wait(&window_barrier);
+
+        // windows and the ranges in them are in index order, so keeping
+        // the first strictly greater max picks the lowest index, same as
+        // a serial scan
+        for (int ii = 0; ii < THREADS; ++ii) {
+            if (ranges[ii].max_s > max_s) {
+                max_v = data_start + ranges[ii].max_v;
+                max_s = ranges[ii].max_s;
+            }
+        }
+        next = data_start + data_count;
+
+        if (ckpt_path) {
+            // the step counts the checkpoint vouches for go to disk first
+            if (out_map && msync(out_map, out_size, MS_SYNC) != 0) {
+                perror("msync");
+            }
+            if (!save_checkpoint(ckpt_path, next, max_v, max_s)) {
+                perror(ckpt_path);
+            }
+        }
+    }
+
+    for (int ii = 0; ii < THREADS; ++ii) {
+        rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
     }
 
     printf("Max steps is at %ld: %ld steps\n", max_v, max_s);
 
-    for (int ii = 0; ii < data_top; ++ii) {
-        free_ivec(tasks[ii]->vals);
-        xfree(tasks[ii]);
+    if (out_map) {
+        munmap(out_map, out_size);
+        close(out_fd);
     }
-    xfree(tasks);
+
+    pthread_barrier_destroy(&phase_barrier);
+    pthread_barrier_destroy(&window_barrier);
+    xfree(steps);
 
     return 0;
 }
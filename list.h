@@ -1,6 +1,9 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "xmalloc.h"
 
 // Linked list cell.
@@ -9,11 +12,57 @@ typedef struct cell {
     struct cell* rest;
 } cell;
 
+#ifdef XMALLOC_POOL
+// Cells come from their own pool. Drivers call list_pool_init() before
+// the first cons and list_pool_destroy() once no lists are left.
+static xpool* cell_pool;
+
+static
+void
+list_pool_init()
+{
+    cell_pool = xpool_create(sizeof(cell));
+}
+
+static
+void
+list_pool_destroy()
+{
+    xpool_destroy(cell_pool);
+}
+
+#define CELL_ALLOC()    ((cell*)xpool_alloc(cell_pool))
+#define CELL_FREE(xs)   xpool_free(cell_pool, (xs))
+#define CELL_FREE_BATCH(ps, nn) xpool_free_batch(cell_pool, (ps), (nn))
+#else
+static
+void
+list_pool_init()
+{
+}
+
+static
+void
+list_pool_destroy()
+{
+}
+
+#define CELL_ALLOC()    XMALLOC_TYPED(cell)
+#define CELL_FREE(xs)   XFREE_TYPED(cell, (xs))
+#define CELL_FREE_BATCH(ps, nn) xfree_batch((ps), (nn))
+#endif
+
 static
 cell*
 cons(long item, cell* rest)
 {
-    cell* xs = xmalloc(sizeof(cell));
+    cell* xs = CELL_ALLOC();
+    if (xs == 0) {
+        // nothing sensible to carry on with, e.g. under a heap limit; a
+        // checkpointed run can be resumed from its last window
+        fprintf(stderr, "cons: out of memory\n");
+        exit(1);
+    }
     xs->item = item;
     xs->rest = rest;
     return xs;
@@ -31,17 +80,50 @@ count_list(cell* xs)
     return nn;
 }
 
+// Cells waiting to be freed. A list's cells were mostly allocated
+// together, so handing them to the allocator in batches lets it take
+// each lock once per batch instead of once per cell.
+#define CELL_BATCH 64
+
+typedef struct cell_batch {
+    void* cells[CELL_BATCH];
+    long  count;
+} cell_batch;
+
 static
 void
-free_list(cell* xs)
+cell_batch_flush(cell_batch* bb)
+{
+    CELL_FREE_BATCH(bb->cells, bb->count);
+    bb->count = 0;
+}
+
+// Queue every cell of xs to be freed, flushing bb whenever it fills.
+// The caller flushes what's left once it's done.
+static
+void
+free_list_deferred(cell_batch* bb, cell* xs)
 {
     while (xs) {
         cell* ys = xs->rest;
-        xfree(xs);
+        bb->cells[bb->count++] = xs;
+        if (bb->count == CELL_BATCH) {
+            cell_batch_flush(bb);
+        }
         xs = ys;
     }
 }
 
+static
+void
+free_list(cell* xs)
+{
+    cell_batch bb;
+    bb.count = 0;
+    free_list_deferred(&bb, xs);
+    cell_batch_flush(&bb);
+}
+
 static
 cell*
 copy_list(cell* xs)
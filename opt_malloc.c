@@ -2,109 +2,225 @@
 #include <pthread.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <math.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
 #include "xmalloc.h"
+#include "opt_malloc.h"
 
 // bucket
 typedef struct bucket_node
 {
     size_t size;
     int arena;
-    struct bucket_node *prev;
+    // the owning shard of a pool page, see xpool_create; 0 otherwise
+    struct xpool_shard *shard;
     struct bucket_node *next;
-    // depends on size. start with all zeros.
-    unsigned char *bitmap;
-    // data goes here
 } bucket_node;
 
+// Page layout: the bucket_node, then the page's free space tracking
+// starting on the next cache line, then the blocks, aligned to their
+// size up to a cache line. Every free reads the header but only add_page
+// writes it, so keeping the tracking off its line means allocs and frees
+// in a page don't invalidate the header for other threads. The tracking
+// starts with the page's open list link, see find_open_mem.
+//
+// Free space is tracked with a bitmap by default. Building with
+// OPT_FREELIST_PAGES switches to a free list, see page_take below.
+#define PAGE_HDR 64
+
+// Set in the size of a pool page, on top of the object size. It keeps
+// pool objects out of the thread cache and sends their xfree to the pool.
+#define POOL_PAGE ((size_t)1 << 62)
+
+// A bucket page is on its arena's open list for its size while it may
+// have a free block.
+typedef struct page_link
+{
+    struct bucket_node *next;
+    int listed;
+} page_link;
+
+static inline page_link *
+page_open(bucket_node *bucket)
+{
+    return (page_link *)((char *)bucket + PAGE_HDR);
+}
+
+// where the bitmap or free list state starts
+#define PAGE_TRACK (PAGE_HDR + sizeof(page_link))
+
+#ifdef OPT_FREELIST_PAGES
+
+// Free blocks are threaded through their first four bytes as offsets
+// into the page, so even the 4 byte bucket can hold a link.
+typedef struct page_free
+{
+    uint32_t head;  // first free block, 0 if there is none
+    uint32_t bump;  // first block that has never been handed out
+    uint32_t used;  // blocks handed out and not given back
+} page_free;
+
+static inline page_free *
+page_state(bucket_node *bucket)
+{
+    return (page_free *)((char *)bucket + PAGE_TRACK);
+}
+
+// offset of the first block in a page
+static inline int
+data_offset(size_t size)
+{
+    int align = size < 64 ? size : 64;
+    return (PAGE_TRACK + sizeof(page_free) + align - 1) / align * align;
+}
+
+#else
+
+static inline unsigned char *
+page_bitmap(bucket_node *bucket)
+{
+    return (unsigned char *)bucket + PAGE_TRACK;
+}
+
+// length of a page's bitmap in bytes
+static inline int
+bitmap_bytes(size_t size)
+{
+    return (((4096 - PAGE_TRACK) / size) / 8) + 1;
+}
+
+// offset of the first block in a page
+static inline int
+data_offset(size_t size)
+{
+    int align = size < 64 ? size : 64;
+    return (PAGE_TRACK + bitmap_bytes(size) + align - 1) / align * align;
+}
+
+#endif
+
 // all the size buckets we will allow.
 static int bucket_sizes[10] = {4, 8, 16, 32, 64, 128, 256, 512, 1024};
 
-// have the buckets been set up yet?
-static char arenas_initialized = 0;
+// Everything one arena owns. Each is padded out to whole cache lines,
+// so threads working in different arenas never write to the same line.
+// OPT_ARENA_PACKED leaves the padding out, for bench.pl to measure it.
+#ifdef OPT_ARENA_PACKED
+#define ARENA_ALIGN
+#else
+#define ARENA_ALIGN __attribute__((aligned(64)))
+#endif
+
+typedef struct arena_state
+{
+    pthread_mutex_t mutex;
+    // every page of each bucket size, in a ring
+    bucket_node *heads[9];
+    // the pages of each size that may have a free block, see find_open_mem
+    bucket_node *open[9];
+    // bytes of pages mapped for this arena, see the heap budget below
+    size_t mapped;
+} ARENA_ALIGN arena_state;
 
 //multiple arenas
-static bucket_node *arenas[8][9];
+static arena_state arenas[8];
 
 static __thread int favorite_arena_index = 0;
 
-// initialization mutex
-static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+// per-thread free block cache, see opt_malloc.h
+__thread opt_cache_bin opt_cache[9];
+__thread int opt_thread_ready = 0;
 
-// one mutex per arenas
-static pthread_mutex_t arena_mutexes[8] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+// hands each new thread the next arena
+static int next_arena = 0;
 
+// global_init runs the first time any thread attaches
+static pthread_once_t global_once = PTHREAD_ONCE_INIT;
 
-// create buckets
-void init_arenas()
-{
-	for (int arena = 0; arena < 8; arena++) 
-	{
-    		for (int i = 0; i < 9; i++)
-    		{
-        		int bucket_size = bucket_sizes[i];
-
-        		bucket_node *bucket = mmap(
-            			0,
-            			4096,
-            			PROT_READ | PROT_WRITE,
-            			MAP_PRIVATE | MAP_ANONYMOUS,
-            			-1,
-            			0);
-
-        		bucket->size = bucket_size;
-        		bucket->next = bucket;
-			    bucket->arena = arena;
-       			bucket->prev = 0; //TODO: fix this later
-        		int bitmap_size = (((4096 - 32) / bucket_size) / 8) + 1;
-
-        		memset((void *)&bucket->bitmap, 0, bitmap_size);
-
-        		arenas[arena][i] = bucket;
-    		}
-	}
+// runs cache_release when a thread that has a cache exits
+static pthread_key_t cache_key;
+
+// blocks a cache miss pulls from the arena on top of the one it returns
+#define OPT_CACHE_REFILL 16
+
+#ifdef OPT_FREELIST_PAGES
 
-	favorite_arena_index = pthread_self() % 8;
+static void
+page_init(bucket_node *bucket, size_t size)
+{
+    page_free *pf = page_state(bucket);
+    pf->head = 0;
+    pf->bump = data_offset(size);
+    pf->used = 0;
 }
 
-// get the index of the bucket that contains items of size 'size'
-size_t get_bucket_size_index(size_t size)
+// take a free block from the page, or return 0 if it is full
+static void *
+page_take(bucket_node *bucket, size_t size)
 {
-    for (int i = 0; i < 9; i++)
+    page_free *pf = page_state(bucket);
+    if (pf->head != 0)
     {
-        if (size == bucket_sizes[i])
-        {
-            return i;
-        }
+        char *blk = (char *)bucket + pf->head;
+        pf->head = *(uint32_t *)blk;
+        pf->used += 1;
+        return blk;
     }
+    if (pf->bump + size <= 4096)
+    {
+        char *blk = (char *)bucket + pf->bump;
+        pf->bump += size;
+        pf->used += 1;
+        return blk;
+    }
+    return 0;
+}
 
-    return -1;
+static void
+page_give(bucket_node *bucket, void *ptr)
+{
+    page_free *pf = page_state(bucket);
+    *(uint32_t *)ptr = pf->head;
+    pf->head = (char *)ptr - (char *)bucket;
+    pf->used -= 1;
 }
 
-// return the bucket size we need
-size_t div_up_bucket(size_t size)
+static int
+page_empty(bucket_node *bucket)
 {
+    return page_state(bucket)->used == 0;
+}
 
-	
-    if (size < 4) {
-        return 4;
-    }
+#else
 
-    for (int i = 0; i < 8; i++)
+static void
+page_init(bucket_node *bucket, size_t size)
+{
+    memset(page_bitmap(bucket), 0, bitmap_bytes(size));
+}
+
+static int
+page_empty(bucket_node *bucket)
+{
+    unsigned char *bitmap = page_bitmap(bucket);
+    int bitmap_size = bitmap_bytes(bucket->size);
+    for (int i = 0; i < bitmap_size; i++)
     {
-        if (size > bucket_sizes[i] && size <= bucket_sizes[i + 1])
+        if (bitmap[i] != 0)
         {
-            return bucket_sizes[i + 1];
+            return 0;
         }
     }
-
-    return size;
+    return 1;
 }
- 
 
 void visualize_bitmap(bucket_node* bucket, size_t size, size_t cpos, size_t bpos) {
-    int bitmap_size = (((4096 - 32) / size) / 8) + 1;
+    int bitmap_size = bitmap_bytes(size);
     //int available_items_space = ((4096 - 24) - bitmap_size) / size;
 
     printf("========================\nBitmap for bucket %p of size %zu\n", bucket, bucket->size);
@@ -113,8 +229,8 @@ void visualize_bitmap(bucket_node* bucket, size_t size, size_t cpos, size_t bpos
     int items_checked = 0;
     for (int i = 0; i < bitmap_size; i++)
     {  
-        unsigned char p = *(unsigned char *)((void *)&bucket->bitmap + i);
-        printf("char at %p %d #%d\n", (unsigned char *)((void *)&bucket->bitmap + i), p, i);
+        unsigned char p = page_bitmap(bucket)[i];
+        printf("char at %p %d #%d\n", page_bitmap(bucket) + i, p, i);
         // inner loop to look at each bit in each byte
         for (int j = 0; j < 8; j++)
         {
@@ -138,44 +254,6 @@ void visualize_bitmap(bucket_node* bucket, size_t size, size_t cpos, size_t bpos
     printf("\n\n");
 }
 
-bucket_node *add_page(size_t size, bucket_node *og_head)
-{
-    int bucket_index = get_bucket_size_index(size);
-
-    bucket_node *new_bucket = mmap(
-        0,
-        4096,
-        PROT_READ | PROT_WRITE,
-        MAP_PRIVATE | MAP_ANONYMOUS,
-        -1,
-        0
-    );
-
-    // this can be optimized by using the prev field.
-    // instead of looping through it, we just the the original
-    // "head" and get the previous to find the "end" of the list
-    bucket_node *current = og_head;
-    while (current->next != og_head)
-    {
-        current = current->next;
-    }
-
-    // when we break, current is "end" of list
-    current->next = new_bucket;
-
-    // insert new bucket into list at FRONT
-    new_bucket->next = og_head;
-    new_bucket->size = size;
-    new_bucket->arena = og_head->arena;
-    new_bucket->prev = 0; 
-    int bitmap_size = (((4096 - 32) / size) / 8) + 1;
-
-    memset((void *)&new_bucket->bitmap, 0, bitmap_size);
-
-    arenas[og_head->arena][bucket_index] = new_bucket;
-    return new_bucket;
-}
-
 void* search_bitmap(size_t bitmap_size, size_t available_items_space, bucket_node* bucket, size_t size) { 
    
     // loop over size of bitmap. keep track of items looked at
@@ -190,7 +268,7 @@ void* search_bitmap(size_t bitmap_size, size_t available_items_space, bucket_nod
             break;
         }    
 
-        unsigned char p = *(unsigned char *)((void *)&bucket->bitmap + i);
+        unsigned char p = page_bitmap(bucket)[i];
         if (p == 255) {
             items_checked += 8;
             continue;
@@ -210,208 +288,1356 @@ void* search_bitmap(size_t bitmap_size, size_t available_items_space, bucket_nod
         int bytes_offset = ((i * 8) + bit_pos) * size;
 
         //set spot we return to 1
-        *(unsigned char *)((void *)&bucket->bitmap + i) = p | bitwise_op;
+        page_bitmap(bucket)[i] = p | bitwise_op;
 
         //return bucket mem location offset by size of  and
         //bytes offset based on free location
-        return ((void *)bucket + 32 + bitmap_size + bytes_offset);
+        return ((void *)bucket + data_offset(size) + bytes_offset);
     }
     return 0;
 }
 
-/*
-*  find_mem_helper 
-*  --------------------
-*   finds an available block of space within a bucket contains blocks of certain size
-    
-    bucket: the bucket where we are looking for free space
-
-    size: the size of the block of memory we are looking for
+// take a free block from the page, or return 0 if it is full
+static void *
+page_take(bucket_node *bucket, size_t size)
+{
+    int bitmap_size = bitmap_bytes(size);
+    int available_items_space = (4096 - data_offset(size)) / size;
+    return search_bitmap(bitmap_size, available_items_space, bucket, size);
+}
 
-    og_head: the bucket that was passed in the very first call of find_mem_helper (remains the same
-    throughout calls)
-*/
-void *find_mem_helper(bucket_node *bucket, size_t size, bucket_node *og_head)
+// clear ptr's bit in its page's bitmap
+static void
+page_give(bucket_node *bucket, void *ptr)
 {
-    // lenght of bitmap in bytes
-    int bitmap_size = (((4096 - 32) / size) / 8) + 1;
-    int available_items_space = ((4096 - 32) - bitmap_size) / size;
+    int bytes_offset = (void*)ptr - (void*) bucket;
+   // printf("offset for free %d\n", bytes_offset);
+    int bitmap_and_offset = bytes_offset - data_offset(bucket->size);
+    int index_in_bitmap = bitmap_and_offset / bucket->size;
 
-    void* return_ptr = search_bitmap(bitmap_size, available_items_space, bucket, size);
-    if (return_ptr != 0) {
-        return return_ptr;
-    }
+    int bit_pos = index_in_bitmap % 8;
+    unsigned char bitwise_op = 1 << bit_pos;
+ 
+    // set right spot in bitmap to 0
+    int char_pos = index_in_bitmap / 8;
+    //printf("attempting free on bucket %p of size %ld, charpos=%d bit=%d\n", (void*)bucket, bucket->size, char_pos, bit_pos);
+    unsigned char p = page_bitmap(bucket)[char_pos];
+
+    //visualize_bitmap(bucket, bucket->size, char_pos, bit_pos);
+    page_bitmap(bucket)[char_pos] = p ^ bitwise_op;
+    //visualize_bitmap(bucket, bucket->size, char_pos, bit_pos);
+}
 
-    // since we finished the loop above, which should return something if the
-    // page contains space, we are here because that page is full and we
-    // now need to create a new page
-    if (bucket->next != og_head)
+#endif
+
+static void *map_pages(size_t size, int arena, int locked);
+
+// put a bucket page on its arena's open list, if it isn't already
+static void
+page_list_open(bucket_node *bucket, int bucket_index)
+{
+    page_link *link = page_open(bucket);
+    if (!link->listed)
     {
-        return find_mem_helper(bucket->next, size, og_head);
+        link->next = arenas[bucket->arena].open[bucket_index];
+        link->listed = 1;
+        arenas[bucket->arena].open[bucket_index] = bucket;
     }
-    else
+}
+
+// map the head page of one bucket list, or return 0 if out of memory
+static bucket_node *
+init_head(int arena, int i)
+{
+    bucket_node *bucket = map_pages(4096, arena, 1);
+    if (bucket == 0)
     {
-        // we need a new page here.
-        bucket_node *new_bucket = add_page(size, og_head);
-        return find_mem_helper(new_bucket, size, og_head);
+        return 0;
     }
+
+    bucket->size = bucket_sizes[i];
+    bucket->next = bucket;
+    bucket->arena = arena;
+    bucket->shard = 0;
+    page_init(bucket, bucket_sizes[i]);
+    page_open(bucket)->listed = 0;
+    page_list_open(bucket, i);
+    return bucket;
 }
 
-// find an open memory spot in a bucket's bitmap
-// if a space does not exist, return null ptr
-void *find_open_mem(size_t size, long a_idx)
+// Bucket lists start empty, and find_open_mem maps each head page the
+// first time its bucket is used, so sizes and arenas nobody touches cost
+// nothing.
+void init_arenas()
 {
-    int bucket_index = get_bucket_size_index(size);
-    bucket_node **selected_arena = arenas[a_idx];
-    bucket_node *bucket = selected_arena[bucket_index];
-    return find_mem_helper(bucket, size, bucket);
+	for (int arena = 0; arena < 8; arena++) 
+	{
+		pthread_mutex_init(&arenas[arena].mutex, 0);
+	}
 }
 
-static size_t
-div_up(size_t xx, size_t yy)
+// get the index of the bucket that contains items of size 'size'
+size_t get_bucket_size_index(size_t size)
 {
-    // This is useful to calculate # of pages
-    // for large allocations.
-    size_t zz = xx / yy;
-
-    if (zz * yy == xx)
+    for (int i = 0; i < 9; i++)
     {
-        return zz;
+        if (size == bucket_sizes[i])
+        {
+            return i;
+        }
     }
-    else
+
+    return -1;
+}
+
+// return the bucket size we need
+size_t div_up_bucket(size_t size)
+{
+
+	
+    if (size < 4) {
+        return 4;
+    }
+
+    for (int i = 0; i < 8; i++)
     {
-        return zz + 1;
+        if (size > bucket_sizes[i] && size <= bucket_sizes[i + 1])
+        {
+            return bucket_sizes[i + 1];
+        }
     }
+
+    return size;
 }
+ 
 
-static void* large_alloc(size_t bytes)
+// Heap budget.
+//
+// Every page and span the allocator maps is charged to the arena it is
+// for, or to LARGE_ARENA for large spans, so the heap's size is known
+// without asking the kernel. Limits come from xmalloc_set_limits or from
+// XMALLOC_SOFT_LIMIT_KB and XMALLOC_HARD_LIMIT_KB, and are off by default.
+//
+// A map that would go past the hard limit first reclaims what it can:
+// cached spans, and the empty pages of every arena whose lock is free.
+// If that isn't enough, it fails and so does the allocation. Crossing the
+// soft limit flags low memory; the next allocation to get out from under
+// its locks then hands back its thread cache, reclaims, and calls the
+// xmalloc_on_low_memory handler, once per crossing.
+
+#define LARGE_ARENA 8
+
+static size_t heap_mapped = 0;
+static size_t large_mapped = 0;
+static size_t soft_limit = 0;
+static size_t hard_limit = 0;
+static void (*low_memory_handler)(size_t mapped) = 0;
+static int low_memory_pending = 0;
+
+static size_t *
+arena_mapped(int arena)
 {
-    size_t num_pages = div_up(bytes + 32, 4096);
-    size_t total_size = num_pages * 4096;
-    //printf("div up %zu,  alloc %zu \n", num_pages, total_size); 
-    struct bucket_node* bucket = mmap(
-        0,
-        total_size,
-        PROT_READ|PROT_WRITE,
-        MAP_PRIVATE|MAP_ANONYMOUS,
-        -1,
-        0
-    );
-
-    bucket->size = total_size;
-    bucket->next = 0;
-    bucket->arena = -1;
-    // ignore bitmap entirely 
-    return ((void*) bucket + 32);
-} 
+    return arena == LARGE_ARENA ? &large_mapped : &arenas[arena].mapped;
+}
 
-void *
-xmalloc(size_t bytes)
+// count size more bytes against the budget, unless that passes the hard
+// limit
+static int
+budget_charge(int arena, size_t size)
 {
-    // initialize buckets
-    if (arenas_initialized == 0)
+    size_t total = __atomic_add_fetch(&heap_mapped, size, __ATOMIC_RELAXED);
+    if (hard_limit && total > hard_limit)
     {
-	pthread_mutex_lock(&init_mutex);
+        __atomic_sub_fetch(&heap_mapped, size, __ATOMIC_RELAXED);
+        return 0;
+    }
+    __atomic_add_fetch(arena_mapped(arena), size, __ATOMIC_RELAXED);
 
-	if (arenas_initialized == 0)
-	{
-		init_arenas();
-		arenas_initialized = 1;
-	}
-	
-	pthread_mutex_unlock(&init_mutex);
+    if (soft_limit && total > soft_limit && total - size <= soft_limit)
+    {
+        __atomic_store_n(&low_memory_pending, 1, __ATOMIC_RELAXED);
     }
+    return 1;
+}
 
-    // find the correct bucket size
-    int dest_bucket = div_up_bucket(bytes);
-    
+static void
+budget_release(int arena, size_t size)
+{
+    __atomic_sub_fetch(arena_mapped(arena), size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&heap_mapped, size, __ATOMIC_RELAXED);
+}
 
-    // if the allocation size is less than our "large" size, go
-    // into the buckets
-    if (dest_bucket <= 1024)
-    { 
-        int arena_index = favorite_arena_index;
+static void release_large_spans(long cutoff_ms);
+static void release_empty_pages(int arena, int bucket_index, int wait, int held);
+static void check_low_memory();
 
-	int rv;
-	rv = pthread_mutex_trylock(&arena_mutexes[arena_index]);
+// Unmap cached spans and empty pages. With wait unset, arenas that are
+// locked are skipped, so this is safe with an arena lock held; held is
+// that arena, whose pages are then released without locking it again,
+// or -1.
+static void
+reclaim(int wait, int held)
+{
+    release_large_spans(LONG_MAX);
+    for (int arena = 0; arena < 8; arena++)
+    {
+        for (int i = 0; i < 9; i++)
+        {
+            release_empty_pages(arena, i, wait, arena == held);
+        }
+    }
+}
 
-	while (rv)
-	{
-		arena_index = (arena_index + 1) % 8;
-		rv = pthread_mutex_trylock(&arena_mutexes[arena_index]);	
-	}
+// mmap fresh pages for arena, or return 0. When the budget or the kernel
+// says no, reclaim and try once more. locked says the caller holds the
+// arena's lock, which is always so for bucket pages; the arena that most
+// often has empty pages to give back is then that one.
+static void *
+map_pages(size_t size, int arena, int locked)
+{
+    int held = locked ? arena : -1;
+    if (!budget_charge(arena, size))
+    {
+        reclaim(0, held);
+        if (!budget_charge(arena, size))
+        {
+            return 0;
+        }
+    }
 
-            
-        // go into the buckets and look for an available block of memory
-        void *open_spot = find_open_mem(dest_bucket, arena_index);
-      
-        pthread_mutex_unlock(&arena_mutexes[arena_index]);
-        return open_spot;
+    void *ptr = mmap(0, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        reclaim(0, held);
+        ptr = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     }
-    // if the allocation is greater than 4096, we might just
-    // need to mmap and return the address
-    else
-    {   
-        void* return_ptr = large_alloc(bytes);
-        return return_ptr;
-       
+    if (ptr == MAP_FAILED)
+    {
+        budget_release(arena, size);
+        return 0;
     }
+    return ptr;
+}
 
-    return 0;
+static void
+unmap_pages(void *ptr, size_t size, int arena)
+{
+    munmap(ptr, size);
+    budget_release(arena, size);
 }
 
-void xfree(void *ptr)
+// map a new page for og_head's bucket list and put it on the open list
+bucket_node *add_page(size_t size, bucket_node *og_head)
 {
-    bucket_node* bucket = (void*)(4096 * ((uintptr_t)ptr / (uintptr_t)4096));
+    int bucket_index = get_bucket_size_index(size);
 
-    if (bucket->size > 1024) {
-        // with large alloc, just munmap
-        munmap((void*) bucket, bucket->size);
+    bucket_node *new_bucket = map_pages(4096, og_head->arena, 1);
+    if (new_bucket == 0)
+    {
+        return 0;
     }
-    else {
-        pthread_mutex_lock(&arena_mutexes[bucket->arena]);
-   
-        int bitmap_size = (((4096 - 32) / bucket->size) / 8) + 1;
 
-        int bytes_offset = (void*)ptr - (void*) bucket;
-       // printf("offset for free %d\n", bytes_offset);
-        int bitmap_and_offset = bytes_offset - 32 - bitmap_size;
-        int index_in_bitmap = bitmap_and_offset / bucket->size;
+    // the ring has no order, so the new page just goes after the head
+    new_bucket->next = og_head->next;
+    new_bucket->size = size;
+    new_bucket->arena = og_head->arena;
+    new_bucket->shard = 0;
+    page_init(new_bucket, size);
+    og_head->next = new_bucket;
 
-        int bit_pos = index_in_bitmap % 8;
-        unsigned char bitwise_op = 1 << bit_pos;
- 
-        // set right spot in bitmap to 0
-        int char_pos = index_in_bitmap / 8;
-        //printf("attempting free on bucket %p of size %ld, charpos=%d bit=%d\n", (void*)bucket, bucket->size, char_pos, bit_pos);
-        unsigned char p = *(unsigned char*)((void*)&bucket->bitmap + char_pos);
+    page_open(new_bucket)->listed = 0;
+    page_list_open(new_bucket, bucket_index);
+    return new_bucket;
+}
+
+// find an open memory spot in a bucket's pages
+// if a space does not exist, return null ptr
+//
+// Only pages on the open list are searched. A page found full comes off
+// it, and goes back on when a block in it is freed, so full pages are
+// passed over at most once however many of them there are.
+void *find_open_mem(size_t size, long a_idx)
+{
+    int bucket_index = get_bucket_size_index(size);
+    bucket_node **selected_arena = arenas[a_idx].heads;
+    bucket_node *head = selected_arena[bucket_index];
+    if (head == 0)
+    {
+        head = selected_arena[bucket_index] = init_head(a_idx, bucket_index);
+        if (head == 0)
+        {
+            return 0;
+        }
+    }
 
-        //visualize_bitmap(bucket, bucket->size, char_pos, bit_pos);
-        *(unsigned char*)((void*)&bucket->bitmap + char_pos) = p ^ bitwise_op;
-        //visualize_bitmap(bucket, bucket->size, char_pos, bit_pos);
+    bucket_node **open = &arenas[a_idx].open[bucket_index];
+    for (;;)
+    {
+        bucket_node *bucket = *open;
+        if (bucket == 0)
+        {
+            // mapping may reclaim empty pages, so reread the list after
+            if (add_page(size, head) == 0)
+            {
+                return 0;
+            }
+            continue;
+        }
 
+        void *return_ptr = page_take(bucket, size);
+        if (return_ptr != 0)
+        {
+            return return_ptr;
+        }
 
-        pthread_mutex_unlock(&arena_mutexes[bucket->arena]);
+        page_link *link = page_open(bucket);
+        *open = link->next;
+        link->listed = 0;
     }
 }
 
-void *
-xrealloc(void *prev, size_t bytes)
+static size_t
+div_up(size_t xx, size_t yy)
 {
-    void* new_ptr = xmalloc(bytes);
-    bucket_node* bucket = (void*)(4096 * ((uintptr_t)prev / (uintptr_t)4096));
-    
-    if (bucket->size <= 1024) {
-        pthread_mutex_lock(&arena_mutexes[bucket->arena]); 
-    }
-
-    memcpy(new_ptr, prev, bucket->size);
+    // This is useful to calculate # of pages
+    // for large allocations.
+    size_t zz = xx / yy;
 
-    if (bucket->size <= 1024) {
-        pthread_mutex_unlock(&arena_mutexes[bucket->arena]);
+    if (zz * yy == xx)
+    {
+        return zz;
+    }
+    else
+    {
+        return zz + 1;
     }
-    
-    xfree(prev);
-    return new_ptr;
 }
 
+// Freed large spans, kept for reuse while the scavenger is running so
+// that xfree doesn't have to munmap. The scavenger unmaps them once they
+// have sat unused for a scan interval.
+#define LARGE_CACHE_SPANS 8
+
+typedef struct large_span
+{
+    bucket_node *span;
+    long freed_ms;
+} large_span;
+
+static pthread_mutex_t large_mutex = PTHREAD_MUTEX_INITIALIZER;
+static large_span large_cache[LARGE_CACHE_SPANS];
+
+// scan interval in ms and RSS target in KB, 0 if there's no scavenger
+static long scavenge_ms = 0;
+static long scavenge_rss_kb = 0;
+
+static long
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// take a cached span of exactly total_size bytes, if there is one
+static bucket_node *
+large_cache_take(size_t total_size)
+{
+    bucket_node *span = 0;
+    pthread_mutex_lock(&large_mutex);
+    for (int i = 0; i < LARGE_CACHE_SPANS; i++)
+    {
+        if (large_cache[i].span && large_cache[i].span->size == total_size)
+        {
+            span = large_cache[i].span;
+            large_cache[i].span = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&large_mutex);
+    return span;
+}
+
+// keep a freed span for reuse, or return 0 if the cache is full
+static int
+large_cache_put(bucket_node *span)
+{
+    int kept = 0;
+    pthread_mutex_lock(&large_mutex);
+    for (int i = 0; i < LARGE_CACHE_SPANS; i++)
+    {
+        if (large_cache[i].span == 0)
+        {
+            large_cache[i].span = span;
+            large_cache[i].freed_ms = now_ms();
+            kept = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&large_mutex);
+    return kept;
+}
+
+// zero: the caller needs the block cleared, which only a reused span isn't
+static void* large_alloc(size_t bytes, int zero)
+{
+    if (!opt_thread_ready)
+    {
+        opt_thread_attach();
+    }
+
+    if (bytes > SIZE_MAX / 2)
+    {
+        return 0;
+    }
+
+    size_t num_pages = div_up(bytes + 32, 4096);
+    size_t total_size = num_pages * 4096;
+
+    if (scavenge_ms > 0)
+    {
+        bucket_node *span = large_cache_take(total_size);
+        if (span)
+        {
+            if (zero)
+            {
+                memset((void*) span + 32, 0, total_size - 32);
+            }
+            return ((void*) span + 32);
+        }
+    }
+
+    //printf("div up %zu,  alloc %zu \n", num_pages, total_size); 
+    struct bucket_node* bucket = map_pages(total_size, LARGE_ARENA, 0);
+    check_low_memory();
+    if (bucket == 0)
+    {
+        return 0;
+    }
+
+    bucket->size = total_size;
+    bucket->next = 0;
+    bucket->arena = -1;
+    // ignore bitmap entirely 
+    return ((void*) bucket + 32);
+} 
+
+// give ptr back to its page, under its arena's lock
+static void
+arena_free(void *ptr)
+{
+    bucket_node* bucket = (void*)(4096 * ((uintptr_t)ptr / (uintptr_t)4096));
+
+    pthread_mutex_lock(&arenas[bucket->arena].mutex);
+
+    page_give(bucket, ptr);
+    page_list_open(bucket, get_bucket_size_index(bucket->size));
+
+    pthread_mutex_unlock(&arenas[bucket->arena].mutex);
+}
+
+// give the blocks in this thread's cache back to their arenas
+static void
+cache_flush()
+{
+    for (int i = 0; i < 9; i++)
+    {
+        opt_free_block *blk = opt_cache[i].head;
+        opt_cache[i].head = 0;
+        opt_cache[i].count = 0;
+        while (blk)
+        {
+            opt_free_block *next = blk->next;
+            arena_free(blk);
+            blk = next;
+        }
+    }
+}
+
+static void pool_thread_exit();
+static void pools_lock();
+static void pools_unlock();
+static void pools_disown_others();
+
+// Runs at thread exit; a free after that just sets the cache up again.
+static void
+cache_release(void *arg)
+{
+    opt_thread_ready = 0;
+    cache_flush();
+    pool_thread_exit();
+}
+
+// Hold every lock across fork() so the child never inherits one that a
+// thread which no longer exists was holding.
+static void
+fork_prepare()
+{
+    for (int i = 0; i < 8; i++)
+    {
+        pthread_mutex_lock(&arenas[i].mutex);
+    }
+    pthread_mutex_lock(&large_mutex);
+    pools_lock();
+}
+
+static void
+fork_release()
+{
+    pools_unlock();
+    pthread_mutex_unlock(&large_mutex);
+    for (int i = 7; i >= 0; i--)
+    {
+        pthread_mutex_unlock(&arenas[i].mutex);
+    }
+}
+
+// The child has no scavenger thread, so stop feeding the span cache, and
+// none of the other threads, so let their pool shards be adopted.
+static void
+fork_child()
+{
+    pools_disown_others();
+    fork_release();
+    scavenge_ms = 0;
+}
+
+// Background scavenger.
+//
+// Off unless XMALLOC_SCAVENGE_MS is set in the environment. When set,
+// the first thread to use the allocator starts a thread that wakes up
+// every XMALLOC_SCAVENGE_MS milliseconds. Each time, it unmaps cached
+// large spans that have gone unused for a whole interval. Then, if RSS
+// is above XMALLOC_RSS_TARGET_KB (default 0, so always), it unmaps every
+// cached span and every empty bucket page except the list heads.
+//
+// Each bucket list is scanned under its arena's lock, but pages are only
+// unlinked there; the munmaps happen after the lock is dropped.
+
+static long
+rss_kb()
+{
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    ssize_t nn = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (nn <= 0)
+    {
+        return 0;
+    }
+    buf[nn] = 0;
+
+    long mapped, resident;
+    if (sscanf(buf, "%ld %ld", &mapped, &resident) != 2)
+    {
+        return 0;
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// unmap cached spans freed at or before cutoff_ms
+static void
+release_large_spans(long cutoff_ms)
+{
+    bucket_node *doomed[LARGE_CACHE_SPANS];
+    int count = 0;
+
+    pthread_mutex_lock(&large_mutex);
+    for (int i = 0; i < LARGE_CACHE_SPANS; i++)
+    {
+        if (large_cache[i].span && large_cache[i].freed_ms <= cutoff_ms)
+        {
+            doomed[count++] = large_cache[i].span;
+            large_cache[i].span = 0;
+        }
+    }
+    pthread_mutex_unlock(&large_mutex);
+
+    for (int i = 0; i < count; i++)
+    {
+        unmap_pages(doomed[i], doomed[i]->size, LARGE_ARENA);
+    }
+}
+
+// unlink and unmap the empty pages of one bucket list; without wait, give
+// up if the arena is locked, unless held says the caller has it locked
+static void
+release_empty_pages(int arena, int bucket_index, int wait, int held)
+{
+    bucket_node *doomed = 0;
+
+    if (!held)
+    {
+        if (wait)
+        {
+            pthread_mutex_lock(&arenas[arena].mutex);
+        }
+        else if (pthread_mutex_trylock(&arenas[arena].mutex) != 0)
+        {
+            return;
+        }
+    }
+
+    bucket_node *head = arenas[arena].heads[bucket_index];
+    if (head == 0)
+    {
+        if (!held)
+        {
+            pthread_mutex_unlock(&arenas[arena].mutex);
+        }
+        return;
+    }
+    bucket_node *prev = head;
+    bucket_node *page = head->next;
+    while (page != head)
+    {
+        bucket_node *next = page->next;
+        if (page_empty(page))
+        {
+            prev->next = next;
+            page->next = doomed;
+            doomed = page;
+            // an empty page is always on the open list
+            page_open(page)->listed = -1;
+        }
+        else
+        {
+            prev = page;
+        }
+        page = next;
+    }
+    if (doomed)
+    {
+        bucket_node **link = &arenas[arena].open[bucket_index];
+        while (*link)
+        {
+            if (page_open(*link)->listed < 0)
+            {
+                *link = page_open(*link)->next;
+            }
+            else
+            {
+                link = &page_open(*link)->next;
+            }
+        }
+    }
+    if (!held)
+    {
+        pthread_mutex_unlock(&arenas[arena].mutex);
+    }
+
+    while (doomed)
+    {
+        bucket_node *next = doomed->next;
+        unmap_pages(doomed, 4096, arena);
+        doomed = next;
+    }
+}
+
+static void *
+scavenger(void *arg)
+{
+    struct timespec interval;
+    interval.tv_sec = scavenge_ms / 1000;
+    interval.tv_nsec = (scavenge_ms % 1000) * 1000000;
+
+    for (;;)
+    {
+        nanosleep(&interval, 0);
+
+        long now = now_ms();
+        if (scavenge_rss_kb > 0 && rss_kb() <= scavenge_rss_kb)
+        {
+            release_large_spans(now - scavenge_ms);
+            continue;
+        }
+
+        reclaim(1, -1);
+    }
+    return 0;
+}
+
+static void
+start_scavenger()
+{
+    const char *ms = getenv("XMALLOC_SCAVENGE_MS");
+    if (ms == 0 || atol(ms) <= 0)
+    {
+        return;
+    }
+
+    const char *target = getenv("XMALLOC_RSS_TARGET_KB");
+    scavenge_rss_kb = target ? atol(target) : 0;
+
+    scavenge_ms = atol(ms);
+
+    // it needs next to no stack; don't let it reserve the default 8 MiB
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, scavenger, 0) != 0)
+    {
+        scavenge_ms = 0;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// The soft limit was crossed: give back what we can, then tell the
+// program. Only called with no allocator lock held.
+static void
+low_memory()
+{
+    if (!__atomic_exchange_n(&low_memory_pending, 0, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    cache_flush();
+    reclaim(1, -1);
+
+    void (*handler)(size_t) = __atomic_load_n(&low_memory_handler, __ATOMIC_ACQUIRE);
+    if (handler)
+    {
+        handler(__atomic_load_n(&heap_mapped, __ATOMIC_RELAXED));
+    }
+}
+
+static void
+check_low_memory()
+{
+    if (__atomic_load_n(&low_memory_pending, __ATOMIC_RELAXED))
+    {
+        low_memory();
+    }
+}
+
+static size_t
+env_kb(const char *name)
+{
+    const char *val = getenv(name);
+    return val && atol(val) > 0 ? (size_t)atol(val) * 1024 : 0;
+}
+
+// set up the arenas, once per process
+static void
+global_init()
+{
+    soft_limit = env_kb("XMALLOC_SOFT_LIMIT_KB");
+    hard_limit = env_kb("XMALLOC_HARD_LIMIT_KB");
+    init_arenas();
+    pthread_key_create(&cache_key, cache_release);
+    pthread_atfork(fork_prepare, fork_release, fork_child);
+    start_scavenger();
+}
+
+// first call into the arenas or the cache from this thread
+void
+opt_thread_attach()
+{
+    pthread_once(&global_once, global_init);
+
+    favorite_arena_index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % 8;
+    opt_thread_ready = 1;
+
+    // the value only needs to be non-null for the destructor to run
+    pthread_setspecific(cache_key, (void *)1);
+}
+
+void
+xmalloc_set_limits(size_t soft, size_t hard)
+{
+    // after global_init, so the environment doesn't override these
+    pthread_once(&global_once, global_init);
+    soft_limit = soft;
+    hard_limit = hard;
+    if (soft && __atomic_load_n(&heap_mapped, __ATOMIC_RELAXED) > soft)
+    {
+        __atomic_store_n(&low_memory_pending, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void
+xmalloc_on_low_memory(void (*handler)(size_t mapped))
+{
+    __atomic_store_n(&low_memory_handler, handler, __ATOMIC_RELEASE);
+}
+
+// take a block from an arena, plus 'extra' more for this thread's cache
+// while we hold the lock
+static void*
+arena_alloc(size_t dest_bucket, int extra)
+{
+    if (!opt_thread_ready)
+    {
+        opt_thread_attach();
+    }
+
+    int arena_index = favorite_arena_index;
+
+    int rv;
+    rv = pthread_mutex_trylock(&arenas[arena_index].mutex);
+
+    while (rv)
+    {
+	arena_index = (arena_index + 1) % 8;
+	rv = pthread_mutex_trylock(&arenas[arena_index].mutex);	
+    }
+
+    // go into the buckets and look for an available block of memory
+    void *open_spot = find_open_mem(dest_bucket, arena_index);
+
+    if (extra > 0)
+    {
+        opt_cache_bin *bin = &opt_cache[get_bucket_size_index(dest_bucket)];
+        for (int i = 0; i < extra && open_spot; i++)
+        {
+            opt_free_block *blk = find_open_mem(dest_bucket, arena_index);
+            if (blk == 0)
+            {
+                break;
+            }
+            blk->next = bin->head;
+            bin->head = blk;
+            bin->count += 1;
+        }
+    }
+
+    pthread_mutex_unlock(&arenas[arena_index].mutex);
+    check_low_memory();
+    return open_spot;
+}
+
+void *
+opt_cache_refill(int bb)
+{
+    return arena_alloc(bucket_sizes[bb], OPT_CACHE_REFILL);
+}
+
+void *
+xmalloc(size_t bytes)
+{
+    // small allocations come from this thread's cache when they can
+    if (OPT_CACHED_SIZE(bytes))
+    {
+        return opt_cache_pop(opt_bucket_index(bytes));
+    }
+
+    // find the correct bucket size
+    int dest_bucket = div_up_bucket(bytes);
+
+    // if the allocation size is less than our "large" size, go
+    // into the buckets
+    if (dest_bucket <= 1024)
+    { 
+        return arena_alloc(dest_bucket, 0);
+    }
+    // if the allocation is greater than 4096, we might just
+    // need to mmap and return the address
+    else
+    {   
+        void* return_ptr = large_alloc(bytes, 0);
+        return return_ptr;
+       
+    }
+
+    return 0;
+}
+
+struct xpool_shard;
+static void shard_free_chain(struct xpool_shard *sh,
+                             opt_free_block *first, opt_free_block *last);
+
+void xfree(void *ptr)
+{
+    // keep it for this thread if its cache has room
+    if (opt_cache_push(ptr)) {
+        return;
+    }
+
+    bucket_node* bucket = (void*)(4096 * ((uintptr_t)ptr / (uintptr_t)4096));
+
+    if (bucket->size & POOL_PAGE) {
+        shard_free_chain(bucket->shard, ptr, ptr);
+    }
+    else if (bucket->size > 1024) {
+        // with large alloc, just munmap, unless the scavenger will do it
+        if (scavenge_ms == 0 || !large_cache_put(bucket)) {
+            unmap_pages((void*) bucket, bucket->size, LARGE_ARENA);
+        }
+    }
+    else {
+        arena_free(ptr);
+    }
+}
+
+// Like xfree on each block, except that a run of small blocks from the
+// same arena goes back under one lock. Blocks the thread cache takes
+// never get that far.
+void
+xfree_batch(void **ptrs, size_t nn)
+{
+    size_t i = 0;
+    while (i < nn)
+    {
+        bucket_node *bucket = (void*)((uintptr_t)ptrs[i] & ~(uintptr_t)4095);
+        if (bucket->size > 1024)
+        {
+            xfree(ptrs[i++]);
+            continue;
+        }
+        if (opt_cache_push(ptrs[i]))
+        {
+            i++;
+            continue;
+        }
+
+        int arena = bucket->arena;
+        pthread_mutex_lock(&arenas[arena].mutex);
+        for (; i < nn; i++)
+        {
+            bucket = (void*)((uintptr_t)ptrs[i] & ~(uintptr_t)4095);
+            if (bucket->size > 1024 || bucket->arena != arena)
+            {
+                break;
+            }
+            page_give(bucket, ptrs[i]);
+            page_list_open(bucket, get_bucket_size_index(bucket->size));
+        }
+        pthread_mutex_unlock(&arenas[arena].mutex);
+    }
+}
+
+void *
+xrealloc(void *prev, size_t bytes)
+{
+    void* new_ptr = xmalloc(bytes);
+    if (new_ptr == 0)
+    {
+        return 0;
+    }
+    bucket_node* bucket = (void*)(4096 * ((uintptr_t)prev / (uintptr_t)4096));
+    
+    if (bucket->size <= 1024) {
+        pthread_mutex_lock(&arenas[bucket->arena].mutex); 
+    }
+
+    // large allocations count their 32 byte header in size
+    size_t old_size = bucket->size <= 1024 ? bucket->size
+                    : bucket->size & POOL_PAGE ? bucket->size & ~POOL_PAGE
+                    : bucket->size - 32;
+    memcpy(new_ptr, prev, old_size < bytes ? old_size : bytes);
+
+    if (bucket->size <= 1024) {
+        pthread_mutex_unlock(&arenas[bucket->arena].mutex);
+    }
+    
+    xfree(prev);
+    return new_ptr;
+}
+
+const char *
+xmalloc_backend()
+{
+    return "opt";
+}
+
+void *
+xcalloc(size_t nn, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nn, size, &bytes))
+    {
+        return 0;
+    }
+
+    // large allocations are fresh anonymous mmaps, already zero, unless
+    // they come from the span cache
+    if (div_up_bucket(bytes) > 1024)
+    {
+        return large_alloc(bytes, 1);
+    }
+
+    // bucket blocks may be recycled
+    void *ptr = xmalloc(bytes);
+    if (ptr)
+    {
+        memset(ptr, 0, bytes);
+    }
+    return ptr;
+}
+
+// Fixed-size object pools.
+//
+// Pool objects live in bucket pages of their own, carved up with
+// page_take like any other bucket page. The header's size is the object
+// size plus POOL_PAGE, and its shard field names the shard that owns the
+// page.
+//
+// Every thread that uses a pool gets a shard of its own. Only the owner
+// touches the shard's pages and local free list, so allocating, and
+// freeing from the owning thread, take no lock. Frees from any other
+// thread are pushed onto the shard's remote list with a CAS; the owner
+// takes that whole list when its local one runs dry. A thread's shards
+// are left behind when it exits, for the next thread that needs one to
+// adopt. The pool mutex only guards the list of shards.
+
+typedef struct xpool_shard
+{
+    opt_free_block *local;
+    // page being carved up; pages are chained through next, newest first
+    bucket_node *page;
+    // &pool_thread of the owning thread, or 0 if nobody owns it
+    void *owner;
+    struct xpool *pool;
+    struct xpool_shard *next;
+    // every other thread writes here, so it gets a line of its own
+    opt_free_block *remote __attribute__((aligned(64)));
+} xpool_shard;
+
+struct xpool
+{
+    pthread_mutex_t mutex;
+    size_t obj_size;
+    // tells a pool apart from an earlier one at the same address
+    long id;
+    xpool_shard *shards;
+    struct xpool *next;
+};
+
+// every live pool, for thread exit and fork
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xpool *pools = 0;
+static long last_pool_id = 0;
+
+// The shards this thread used most recently, so that finding its shard
+// usually takes no lock.
+#define POOL_SLOTS 4
+
+typedef struct pool_slot
+{
+    xpool *pool;
+    long id;
+    xpool_shard *shard;
+} pool_slot;
+
+static __thread pool_slot pool_slots[POOL_SLOTS];
+static __thread int pool_slot_next = 0;
+
+// its address stands for this thread in xpool_shard.owner
+static __thread char pool_thread;
+
+xpool *
+xpool_create(size_t obj_size)
+{
+    // room for the free list link, and keep objects 8 byte aligned
+    if (obj_size < sizeof(opt_free_block))
+    {
+        obj_size = sizeof(opt_free_block);
+    }
+    obj_size = (obj_size + 7) / 8 * 8;
+    if (obj_size > 1024)
+    {
+        return 0;
+    }
+
+    xpool *pool = xmalloc(sizeof(xpool));
+    if (pool == 0)
+    {
+        return 0;
+    }
+    pthread_mutex_init(&pool->mutex, 0);
+    pool->obj_size = obj_size;
+    pool->shards = 0;
+
+    pthread_mutex_lock(&pools_mutex);
+    pool->id = ++last_pool_id;
+    pool->next = pools;
+    pools = pool;
+    pthread_mutex_unlock(&pools_mutex);
+    return pool;
+}
+
+// Find or make this thread's shard of pool: one it already owns, else
+// one nobody owns, else a new one.
+static xpool_shard *
+pool_attach(xpool *pool)
+{
+    // allocated before taking the pool lock, so that lock never has an
+    // arena lock taken under it
+    xpool_shard *fresh = xmalloc(sizeof(xpool_shard));
+
+    pthread_mutex_lock(&pool->mutex);
+    xpool_shard *sh = 0;
+    for (xpool_shard *it = pool->shards; it; it = it->next)
+    {
+        if (it->owner == &pool_thread)
+        {
+            sh = it;
+            break;
+        }
+        if (it->owner == 0 && sh == 0)
+        {
+            sh = it;
+        }
+    }
+    if (sh == 0 && fresh)
+    {
+        memset(fresh, 0, sizeof(xpool_shard));
+        fresh->pool = pool;
+        fresh->next = pool->shards;
+        pool->shards = fresh;
+        sh = fresh;
+        fresh = 0;
+    }
+    if (sh)
+    {
+        __atomic_store_n(&sh->owner, &pool_thread, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (fresh)
+    {
+        xfree(fresh);
+    }
+    if (sh)
+    {
+        pool_slot *slot = &pool_slots[pool_slot_next];
+        pool_slot_next = (pool_slot_next + 1) % POOL_SLOTS;
+        slot->pool = pool;
+        slot->id = pool->id;
+        slot->shard = sh;
+    }
+    return sh;
+}
+
+static inline xpool_shard *
+pool_shard(xpool *pool)
+{
+    for (int i = 0; i < POOL_SLOTS; i++)
+    {
+        if (pool_slots[i].pool == pool && pool_slots[i].id == pool->id)
+        {
+            return pool_slots[i].shard;
+        }
+    }
+    return pool_attach(pool);
+}
+
+// carve an object out of the shard's current page, or a new one when
+// that is full; new pages count against this thread's arena
+static void *
+shard_take(xpool_shard *sh)
+{
+    size_t size = sh->pool->obj_size;
+    if (sh->page)
+    {
+        void *ptr = page_take(sh->page, size);
+        if (ptr)
+        {
+            return ptr;
+        }
+    }
+
+    if (!opt_thread_ready)
+    {
+        opt_thread_attach();
+    }
+
+    bucket_node *page = map_pages(4096, favorite_arena_index, 0);
+    if (page == 0)
+    {
+        check_low_memory();
+        return 0;
+    }
+    page->size = POOL_PAGE | size;
+    page->arena = favorite_arena_index;
+    page->shard = sh;
+    page->next = sh->page;
+    page_init(page, size);
+    sh->page = page;
+
+    void *ptr = page_take(page, size);
+    check_low_memory();
+    return ptr;
+}
+
+void *
+xpool_alloc(xpool *pool)
+{
+    xpool_shard *sh = pool_shard(pool);
+    if (sh == 0)
+    {
+        return 0;
+    }
+
+    opt_free_block *blk = sh->local;
+    if (blk == 0 && __atomic_load_n(&sh->remote, __ATOMIC_RELAXED))
+    {
+        blk = __atomic_exchange_n(&sh->remote, 0, __ATOMIC_ACQUIRE);
+    }
+    if (blk)
+    {
+        sh->local = blk->next;
+        return blk;
+    }
+    return shard_take(sh);
+}
+
+// give sh the chain of objects from first to last
+static void
+shard_free_chain(xpool_shard *sh, opt_free_block *first, opt_free_block *last)
+{
+    // only this thread can make itself the owner, or stop being it
+    if (__atomic_load_n(&sh->owner, __ATOMIC_RELAXED) == &pool_thread)
+    {
+        last->next = sh->local;
+        sh->local = first;
+        return;
+    }
+
+    // the owner only ever takes the whole list, so a plain push is safe
+    opt_free_block *head = __atomic_load_n(&sh->remote, __ATOMIC_RELAXED);
+    do
+    {
+        last->next = head;
+    } while (!__atomic_compare_exchange_n(&sh->remote, &head, first, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static inline xpool_shard *
+pool_shard_of(void *ptr)
+{
+    return ((bucket_node *)((uintptr_t)ptr & ~(uintptr_t)4095))->shard;
+}
+
+void
+xpool_free(xpool *pool, void *ptr)
+{
+    shard_free_chain(pool_shard_of(ptr), ptr, ptr);
+}
+
+// Each run of objects from one shard is chained up first and handed
+// over at once.
+void
+xpool_free_batch(xpool *pool, void **ptrs, size_t nn)
+{
+    size_t i = 0;
+    while (i < nn)
+    {
+        xpool_shard *sh = pool_shard_of(ptrs[i]);
+        opt_free_block *first = ptrs[i];
+        opt_free_block *last = first;
+        for (i++; i < nn && pool_shard_of(ptrs[i]) == sh; i++)
+        {
+            last->next = ptrs[i];
+            last = ptrs[i];
+        }
+        shard_free_chain(sh, first, last);
+    }
+}
+
+void
+xpool_destroy(xpool *pool)
+{
+    pthread_mutex_lock(&pools_mutex);
+    xpool **link = &pools;
+    while (*link != pool)
+    {
+        link = &(*link)->next;
+    }
+    *link = pool->next;
+    pthread_mutex_unlock(&pools_mutex);
+
+    xpool_shard *sh = pool->shards;
+    while (sh)
+    {
+        bucket_node *page = sh->page;
+        while (page)
+        {
+            bucket_node *next = page->next;
+            unmap_pages(page, 4096, page->arena);
+            page = next;
+        }
+        xpool_shard *next = sh->next;
+        xfree(sh);
+        sh = next;
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    xfree(pool);
+}
+
+// Give up the shards this thread owns, from cache_release at thread exit.
+static void
+pool_thread_exit()
+{
+    // the first shard a thread gets goes in slot 0
+    if (pool_slots[0].pool == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pools_mutex);
+    for (xpool *pool = pools; pool; pool = pool->next)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        for (xpool_shard *sh = pool->shards; sh; sh = sh->next)
+        {
+            if (sh->owner == &pool_thread)
+            {
+                __atomic_store_n(&sh->owner, 0, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pools_mutex);
+
+    memset(pool_slots, 0, sizeof(pool_slots));
+    pool_slot_next = 0;
+}
+
+// Lock the pool list and every pool in it, for fork_prepare.
+static void
+pools_lock()
+{
+    pthread_mutex_lock(&pools_mutex);
+    for (xpool *pool = pools; pool; pool = pool->next)
+    {
+        pthread_mutex_lock(&pool->mutex);
+    }
+}
+
+static void
+pools_unlock()
+{
+    for (xpool *pool = pools; pool; pool = pool->next)
+    {
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pools_mutex);
+}
+
+// In a fork child, with the pools locked: the only thread left is this
+// one, so the shards of every other thread are free to adopt.
+static void
+pools_disown_others()
+{
+    for (xpool *pool = pools; pool; pool = pool->next)
+    {
+        for (xpool_shard *sh = pool->shards; sh; sh = sh->next)
+        {
+            if (sh->owner != &pool_thread)
+            {
+                sh->owner = 0;
+            }
+        }
+    }
+}
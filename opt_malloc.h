@@ -0,0 +1,171 @@
+#ifndef OPT_MALLOC_H
+#define OPT_MALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xmalloc.h"
+
+// API that only opt_malloc.c provides. Programs that use it are built
+// against opt alone and include this header, directly or through
+// xmalloc.h with XMALLOC_POOL or XMALLOC_OPT_INLINE defined, so linking
+// them with any other backend fails to compile rather than to link.
+
+// Pools of fixed-size objects, with a bulk xpool_destroy. Objects can also
+// be given back with xfree.
+typedef struct xpool xpool;
+
+xpool* xpool_create(size_t obj_size);
+void*  xpool_alloc(xpool* pool);
+void   xpool_free(xpool* pool, void* ptr);
+void   xpool_free_batch(xpool* pool, void** ptrs, size_t nn);
+void   xpool_destroy(xpool* pool);
+
+// Heap budget in bytes; 0 means no limit. Past soft, the allocator gives
+// back the memory it can and calls the low memory handler. Past hard,
+// allocations fail with 0. The environment variables
+// XMALLOC_SOFT_LIMIT_KB and XMALLOC_HARD_LIMIT_KB set them too.
+void xmalloc_set_limits(size_t soft, size_t hard);
+void xmalloc_on_low_memory(void (*handler)(size_t mapped));
+
+// Inline fast path for opt_malloc.c.
+//
+// Each thread keeps a small cache of free blocks per bucket, threaded
+// through the blocks themselves. Blocks in a cache still look allocated
+// in their page's bitmap, so only the owning thread ever touches them
+// and no lock is needed. xmalloc.h pulls this in when XMALLOC_OPT_INLINE
+// is defined, and then calls with a compile-time constant size pop
+// straight from the cache without leaving the caller.
+
+// The cache itself lives in opt_malloc.c and is always on; this header
+// only adds the inline entry points.
+
+// the 4 byte bucket can't hold a next pointer, so it isn't cached
+#define OPT_CACHE_MIN   8
+#define OPT_CACHE_MAX   1024
+
+// does a request for nn bytes go through the cache?
+#define OPT_CACHED_SIZE(nn) ((nn) > 4 && (nn) <= OPT_CACHE_MAX)
+
+// Bucket index for nn bytes as a constant expression, for sizes known at
+// compile time.
+#define OPT_BUCKET_INDEX(nn) \
+    ((nn) <= 4 ? 0 : (nn) <= 8 ? 1 : (nn) <= 16 ? 2 : (nn) <= 32 ? 3 : \
+     (nn) <= 64 ? 4 : (nn) <= 128 ? 5 : (nn) <= 256 ? 6 : (nn) <= 512 ? 7 : 8)
+
+// most blocks a thread keeps per bucket before xfree goes to the arena
+#define OPT_CACHE_BLOCKS 64
+
+typedef struct opt_free_block {
+    struct opt_free_block* next;
+} opt_free_block;
+
+typedef struct opt_cache_bin {
+    opt_free_block* head;
+    long            count;
+} opt_cache_bin;
+
+extern __thread opt_cache_bin opt_cache[9];
+
+// set once this thread has an arena and will hand its cache back at exit
+extern __thread int opt_thread_ready;
+void opt_thread_attach();
+
+// Out-of-line slow path: refill bucket bb's cache from the arena and
+// return one block.
+void* opt_cache_refill(int bb);
+
+// Index of the bucket that holds bytes, for 4 < bytes <= 1024.
+static inline
+int
+opt_bucket_index(size_t bytes)
+{
+    return 64 - __builtin_clzl(bytes - 1) - 2;
+}
+
+static inline
+void*
+opt_cache_pop(int bb)
+{
+    opt_cache_bin* bin = &opt_cache[bb];
+    opt_free_block* blk = bin->head;
+    if (blk) {
+        bin->head = blk->next;
+        bin->count -= 1;
+        return blk;
+    }
+    return opt_cache_refill(bb);
+}
+
+static inline
+int
+opt_cache_put(int bb, void* ptr)
+{
+    if (!opt_thread_ready) {
+        opt_thread_attach();
+    }
+
+    opt_cache_bin* bin = &opt_cache[bb];
+    if (bin->count >= OPT_CACHE_BLOCKS) {
+        return 0;
+    }
+
+    opt_free_block* blk = ptr;
+    blk->next = bin->head;
+    bin->head = blk;
+    bin->count += 1;
+    return 1;
+}
+
+// Push ptr onto this thread's cache if it is a small block and there's
+// room. Every page and large allocation starts with its size.
+static inline
+int
+opt_cache_push(void* ptr)
+{
+    size_t size = *(size_t*)((uintptr_t)ptr & ~(uintptr_t)4095);
+    if (size < OPT_CACHE_MIN || size > OPT_CACHE_MAX) {
+        return 0;
+    }
+    return opt_cache_put(opt_bucket_index(size), ptr);
+}
+
+#ifdef XMALLOC_OPT_INLINE
+
+static inline
+void
+opt_xfree_inline(void* ptr)
+{
+    if (!opt_cache_push(ptr)) {
+        (xfree)(ptr);
+    }
+}
+
+// Free a block whose bucket is known at compile time, without looking
+// at its page.
+static inline
+void
+opt_xfree_bucket(int bb, void* ptr)
+{
+    if (!opt_cache_put(bb, ptr)) {
+        (xfree)(ptr);
+    }
+}
+
+#define xmalloc(nn) \
+    (__builtin_constant_p(nn) && OPT_CACHED_SIZE(nn) \
+     ? opt_cache_pop(OPT_BUCKET_INDEX(nn)) : (xmalloc)(nn))
+
+#define xfree(pp) opt_xfree_inline(pp)
+
+#define XMALLOC_TYPED(T) \
+    ((T*)(OPT_CACHED_SIZE(sizeof(T)) \
+          ? opt_cache_pop(OPT_BUCKET_INDEX(sizeof(T))) : (xmalloc)(sizeof(T))))
+
+#define XFREE_TYPED(T, pp) \
+    (OPT_CACHED_SIZE(sizeof(T)) \
+     ? opt_xfree_bucket(OPT_BUCKET_INDEX(sizeof(T)), (pp)) : opt_xfree_inline(pp))
+
+#endif
+
+#endif
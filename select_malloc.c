@@ -0,0 +1,172 @@
+// Allocator backend picked at startup.
+//
+// sys_malloc.c, hwx_malloc.c and opt_malloc.c are all linked in, with
+// their entry points renamed to sys_xmalloc, hwx_xmalloc, opt_xmalloc and
+// so on (see SELECT_RENAME in the Makefile). $XMALLOC_BACKEND names the
+// one to use, opt by default.
+//
+// Each xmalloc entry point is a single indirect jump through a slot in
+// the dispatch table, like an IFUNC: nothing is checked per call. A GNU
+// ifunc resolver would run before the environment is set up in a
+// dynamically linked program, so instead every slot starts out pointing
+// at a stub that fills in the whole table on the first call and then
+// goes on to the real function.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xmalloc.h"
+
+typedef struct xmalloc_ops {
+    const char* name;
+    void* (*xmalloc)(size_t bytes);
+    void  (*xfree)(void* ptr);
+    void* (*xrealloc)(void* prev, size_t bytes);
+    void* (*xcalloc)(size_t nn, size_t size);
+    void  (*xfree_batch)(void** ptrs, size_t nn);
+} xmalloc_ops;
+
+#define BACKEND_DECLS(be) \
+    void* be##_xmalloc(size_t bytes); \
+    void  be##_xfree(void* ptr); \
+    void* be##_xrealloc(void* prev, size_t bytes); \
+    void* be##_xcalloc(size_t nn, size_t size); \
+    void  be##_xfree_batch(void** ptrs, size_t nn);
+
+#define BACKEND_OPS(be) \
+    { #be, be##_xmalloc, be##_xfree, be##_xrealloc, be##_xcalloc, be##_xfree_batch }
+
+BACKEND_DECLS(sys)
+BACKEND_DECLS(hwx)
+BACKEND_DECLS(opt)
+
+static const xmalloc_ops backends[] = {
+    BACKEND_OPS(sys),
+    BACKEND_OPS(hwx),
+    BACKEND_OPS(opt),
+};
+
+#define DEFAULT_BACKEND 2
+
+static void* resolve_xmalloc(size_t bytes);
+static void  resolve_xfree(void* ptr);
+static void* resolve_xrealloc(void* prev, size_t bytes);
+static void* resolve_xcalloc(size_t nn, size_t size);
+static void  resolve_xfree_batch(void** ptrs, size_t nn);
+
+static xmalloc_ops dispatch = {
+    0, resolve_xmalloc, resolve_xfree, resolve_xrealloc, resolve_xcalloc,
+    resolve_xfree_batch,
+};
+
+// Fill in the dispatch table. Threads that race here all write the same
+// values, so there's nothing to lock; every read of a slot is an atomic
+// load to match, which costs nothing over a plain one.
+static
+void
+resolve()
+{
+    const char* name = getenv("XMALLOC_BACKEND");
+    const xmalloc_ops* ops = &backends[DEFAULT_BACKEND];
+    if (name && *name) {
+        ops = 0;
+        for (int ii = 0; ii < sizeof(backends) / sizeof(backends[0]); ++ii) {
+            if (strcmp(name, backends[ii].name) == 0) {
+                ops = &backends[ii];
+            }
+        }
+        if (ops == 0) {
+            fprintf(stderr, "XMALLOC_BACKEND=%s: want sys, hwx or opt\n", name);
+            exit(1);
+        }
+    }
+
+    __atomic_store_n(&dispatch.name, ops->name, __ATOMIC_RELAXED);
+    __atomic_store_n(&dispatch.xmalloc, ops->xmalloc, __ATOMIC_RELAXED);
+    __atomic_store_n(&dispatch.xfree, ops->xfree, __ATOMIC_RELAXED);
+    __atomic_store_n(&dispatch.xrealloc, ops->xrealloc, __ATOMIC_RELAXED);
+    __atomic_store_n(&dispatch.xcalloc, ops->xcalloc, __ATOMIC_RELAXED);
+    __atomic_store_n(&dispatch.xfree_batch, ops->xfree_batch, __ATOMIC_RELAXED);
+}
+
+static
+void*
+resolve_xmalloc(size_t bytes)
+{
+    resolve();
+    return __atomic_load_n(&dispatch.xmalloc, __ATOMIC_RELAXED)(bytes);
+}
+
+static
+void
+resolve_xfree(void* ptr)
+{
+    resolve();
+    __atomic_load_n(&dispatch.xfree, __ATOMIC_RELAXED)(ptr);
+}
+
+static
+void*
+resolve_xrealloc(void* prev, size_t bytes)
+{
+    resolve();
+    return __atomic_load_n(&dispatch.xrealloc, __ATOMIC_RELAXED)(prev, bytes);
+}
+
+static
+void*
+resolve_xcalloc(size_t nn, size_t size)
+{
+    resolve();
+    return __atomic_load_n(&dispatch.xcalloc, __ATOMIC_RELAXED)(nn, size);
+}
+
+static
+void
+resolve_xfree_batch(void** ptrs, size_t nn)
+{
+    resolve();
+    __atomic_load_n(&dispatch.xfree_batch, __ATOMIC_RELAXED)(ptrs, nn);
+}
+
+void*
+xmalloc(size_t bytes)
+{
+    return __atomic_load_n(&dispatch.xmalloc, __ATOMIC_RELAXED)(bytes);
+}
+
+void
+xfree(void* ptr)
+{
+    __atomic_load_n(&dispatch.xfree, __ATOMIC_RELAXED)(ptr);
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    return __atomic_load_n(&dispatch.xrealloc, __ATOMIC_RELAXED)(prev, bytes);
+}
+
+void*
+xcalloc(size_t nn, size_t size)
+{
+    return __atomic_load_n(&dispatch.xcalloc, __ATOMIC_RELAXED)(nn, size);
+}
+
+void
+xfree_batch(void** ptrs, size_t nn)
+{
+    __atomic_load_n(&dispatch.xfree_batch, __ATOMIC_RELAXED)(ptrs, nn);
+}
+
+const char*
+xmalloc_backend()
+{
+    const char* name = __atomic_load_n(&dispatch.name, __ATOMIC_RELAXED);
+    if (name == 0) {
+        resolve();
+        name = __atomic_load_n(&dispatch.name, __ATOMIC_RELAXED);
+    }
+    return name;
+}
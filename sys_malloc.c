@@ -15,8 +15,29 @@ xfree(void* ptr)
     free(ptr);
 }
 
+void
+xfree_batch(void** ptrs, size_t nn)
+{
+    for (size_t ii = 0; ii < nn; ++ii) {
+        free(ptrs[ii]);
+    }
+}
+
 void*
 xrealloc(void* prev, size_t bytes)
 {
     return realloc(prev, bytes);
 }
+
+void*
+xcalloc(size_t nn, size_t size)
+{
+    // glibc checks for overflow and skips clearing fresh mmap'd chunks
+    return calloc(nn, size);
+}
+
+const char*
+xmalloc_backend()
+{
+    return "sys";
+}
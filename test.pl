@@ -4,7 +4,7 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 14;
+use Test::Simple tests => 26;
 
 sub crc_check {
     my ($file, $expect) = @_;
@@ -15,9 +15,9 @@ sub crc_check {
     }
 }
 
-crc_check("ivec_main.c", "cae7f5aa");
-crc_check("list_main.c", "0ae6f792");
-crc_check("frag_main.c", "d8d3af29");
+crc_check("ivec_main.c", "c73e18c0");
+crc_check("list_main.c", "207e199e");
+crc_check("frag_main.c", "a2860985");
 
 sub get_time {
     my $data = `cat time.tmp | grep ^real`;
@@ -59,10 +59,18 @@ $par_v = run_prog("collatz-ivec-opt", 10000);
 $pv_ok = $par_v =~ /at 6171: 261 steps/;
 ok($pv_ok, "ivec-opt 10k");
 
+$par_v = run_prog("collatz-ivec-opt", "-i 10000");
+$pv_ok = $par_v =~ /at 6171: 261 steps/;
+ok($pv_ok, "ivec-opt in-place 10k");
+
 $par_l = run_prog("collatz-list-opt", 10000);
 $pl_ok = $par_l =~ /at 6171: 261 steps/;
 ok($pl_ok, "list-opt 10k");
 
+$par_l = run_prog("collatz-list-opt", "6000 7000");
+$pl_ok = $par_l =~ /at 6171: 261 steps/;
+ok($pl_ok, "list-opt range 6k-7k");
+
 $par_v = run_prog("collatz-ivec-opt", 500000);
 $pv_ok = $par_v =~ /at 410011: 448 steps/;
 ok($pv_ok, "ivec-opt 500k");
@@ -71,10 +79,77 @@ $par_l = run_prog("collatz-list-opt", 500000);
 $pl_ok = $par_l =~ /at 410011: 448 steps/;
 ok($pl_ok, "list-opt 500k");
 
+$par_v = run_prog("collatz-ivec-opt", "-f 500000");
+$pv_ok = $par_v =~ /at 410011: 448 steps/;
+ok($pv_ok, "ivec-opt fast 500k");
+
+$par_l = run_prog("collatz-list-opt", "-f 500000");
+$pl_ok = $par_l =~ /at 410011: 448 steps/;
+ok($pl_ok, "list-opt fast 500k");
+
+$par_l = run_prog("collatz-list-opt", "-f -w 30000 500000");
+ok($par_l =~ /at 410011: 448 steps/, "list-opt windowed 500k");
+
+my $inl_l = run_prog("collatz-list-opt-inline", 10000);
+ok($inl_l =~ /at 6171: 261 steps/, "list-opt typed cells without pools 10k");
+
+# Kill a checkpointed run partway and resume it; the step counts it
+# writes have to come out the same as an uninterrupted run's.
+sub checkpoint_next {
+    open(my $fh, "<", "ckpt.tmp") or return 0;
+    my @fields = split(/\s+/, <$fh> // "");
+    close($fh);
+    return $fields[3] // 0;
+}
+
+system("rm -f full.tmp part.tmp ckpt.tmp ckpt.tmp.tmp");
+my $full = run_prog("collatz-list-opt", "-f -w 20000 -o full.tmp 3000000");
+my $pid = fork();
+if ($pid == 0) {
+    open(STDOUT, ">", "/dev/null");
+    exec("./collatz-list-opt", qw(-f -w 20000 -c ckpt.tmp -o part.tmp 3000000));
+    exit(1);
+}
+for (my $ii = 0; $ii < 4000 && checkpoint_next() == 0; ++$ii) {
+    select(undef, undef, undef, 0.005);
+}
+kill("KILL", $pid);
+waitpid($pid, 0);
+my $cut = checkpoint_next();
+my $resumed = run_prog("collatz-list-opt", "-f -w 20000 -c ckpt.tmp --resume -o part.tmp 3000000");
+ok($cut > 0 && $cut < 3000000 && $full =~ /at 2298025: 559 steps/
+   && $resumed eq $full && system("cmp -s full.tmp part.tmp") == 0,
+   "list-opt resumed after kill matches full run");
+system("rm -f full.tmp part.tmp ckpt.tmp ckpt.tmp.tmp");
+
 my $fragt = run_prog("frag-opt", 1);
 my $ft_ok = $fragt =~ /frag test ok/;
 ok($ft_ok, "fragmentation test");
 
+$fragt = run_prog("frag-opt", "1 10 12");
+ok($fragt =~ /frag test ok/, "fragmentation test at 12 MB");
+
+my $fragh = run_prog("frag-hwx", 1);
+ok($fragh =~ /frag test ok/, "fragmentation test hwx");
+
+my $sel_ok = 1;
+for my $be (qw(sys hwx opt)) {
+    local $ENV{XMALLOC_BACKEND} = $be;
+    $sel_ok &&= run_prog("collatz-list", 1000) =~ /at 871: 178 steps/;
+}
+ok($sel_ok, "list 1k with each XMALLOC_BACKEND");
+
+my $budget = run_prog("budget-opt", 3);
+ok($budget =~ /budget test ok/, "heap budget free and reallocate");
+
+{
+    # running out under a hard limit has to end the run cleanly, not crash
+    local $ENV{XMALLOC_HARD_LIMIT_KB} = 2000;
+    my $rv = system("timeout -k 30 20 ./collatz-list-opt 200000 > /dev/null 2> outp.tmp");
+    my $err = `cat outp.tmp`;
+    ok($rv >> 8 == 1 && $err =~ /out of memory/, "list-opt out of memory under hard limit");
+}
+
 sub clang_check {
     my $errs = `clang-check *.c -- 2>&1`;
     chomp $errs;
@@ -0,0 +1,278 @@
+
+// Allocation tracing shim.
+//
+// Provides the xmalloc API on top of a backend whose entry points were
+// renamed to backend_xmalloc, backend_xfree and so on (see
+// TRACE_RENAME in the Makefile). Every call is logged as a trace_rec into
+// a per-thread buffer. A full buffer, the buffer of an exiting thread and
+// the main thread's buffer at exit are appended to the file named by
+// $XMALLOC_TRACE, or xmalloc.trace by default.
+//
+// The result can be replayed against any backend with xmalloc-replay.
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+void* backend_xmalloc(size_t bytes);
+void  backend_xfree(void* ptr);
+void  backend_xfree_batch(void** ptrs, size_t nn);
+void* backend_xrealloc(void* prev, size_t bytes);
+void* backend_xcalloc(size_t nn, size_t size);
+const char* backend_xmalloc_backend();
+
+// records per thread buffer, 2.5 MiB
+#define TRACE_BUF_RECS 65536
+
+typedef struct trace_buf {
+    uint32_t  tid;
+    long      count;
+    trace_rec recs[TRACE_BUF_RECS];
+} trace_buf;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buf_key;
+static int trace_fd = -1;
+static uint64_t trace_t0;
+static uint32_t next_tid = 0;
+
+static __thread trace_buf* my_buf = 0;
+
+// Set once this thread's buffer has been flushed and unmapped by the key
+// destructor. Calls made after that, from other destructors, go straight
+// to the file one record at a time instead of mapping a new buffer.
+static __thread int my_buf_gone = 0;
+static __thread uint32_t my_tid;
+static __thread uint64_t my_seq = 0;
+
+static
+uint64_t
+mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static
+void
+write_recs(trace_rec* recs, long count)
+{
+    if (count == 0 || trace_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&file_mutex);
+    char* data = (char*)recs;
+    size_t left = count * sizeof(trace_rec);
+    while (left > 0) {
+        ssize_t nn = write(trace_fd, data, left);
+        if (nn <= 0) {
+            perror("xmalloc trace");
+            break;
+        }
+        data += nn;
+        left -= nn;
+    }
+    pthread_mutex_unlock(&file_mutex);
+}
+
+static
+void
+flush_buf(trace_buf* tb)
+{
+    write_recs(tb->recs, tb->count);
+    tb->count = 0;
+}
+
+static
+void
+thread_exit(void* arg)
+{
+    trace_buf* tb = arg;
+    flush_buf(tb);
+    munmap(tb, sizeof(trace_buf));
+    my_buf = 0;
+    my_buf_gone = 1;
+}
+
+static
+void
+process_exit()
+{
+    if (my_buf) {
+        flush_buf(my_buf);
+    }
+}
+
+// Flush this thread's records and hold the file lock across fork(), so
+// the child can't inherit it held by a thread it doesn't have.
+static
+void
+fork_prepare()
+{
+    if (my_buf) {
+        flush_buf(my_buf);
+    }
+    pthread_mutex_lock(&file_mutex);
+}
+
+static
+void
+fork_parent()
+{
+    pthread_mutex_unlock(&file_mutex);
+}
+
+// The child shares the parent's file offset and would reuse its thread
+// numbers, so it stops tracing; whatever the parent had buffered is the
+// parent's to write.
+static
+void
+fork_child()
+{
+    pthread_mutex_unlock(&file_mutex);
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    if (my_buf) {
+        my_buf->count = 0;
+    }
+}
+
+static
+void
+trace_init()
+{
+    const char* path = getenv("XMALLOC_TRACE");
+    if (!path) {
+        path = "xmalloc.trace";
+    }
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0) {
+        perror(path);
+    }
+
+    trace_t0 = mono_ns();
+    pthread_key_create(&buf_key, thread_exit);
+    atexit(process_exit);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+static
+trace_buf*
+get_buf()
+{
+    if (my_buf == 0 && !my_buf_gone) {
+        pthread_once(&trace_once, trace_init);
+
+        my_buf = mmap(0, sizeof(trace_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (my_buf == MAP_FAILED) {
+            my_buf = 0;
+            return 0;
+        }
+        my_tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+        my_buf->tid = my_tid;
+        my_buf->count = 0;
+        pthread_setspecific(buf_key, my_buf);
+    }
+    return my_buf;
+}
+
+static
+void
+record(int op, void* ptr, size_t size)
+{
+    trace_buf* tb = get_buf();
+    if (trace_fd < 0) {
+        // not tracing: the file didn't open, or this is a forked child
+        return;
+    }
+    if (!tb) {
+        if (my_buf_gone) {
+            trace_rec rec = { mono_ns() - trace_t0, my_seq++, (uintptr_t)ptr,
+                              size, my_tid, op, 0 };
+            write_recs(&rec, 1);
+        }
+        return;
+    }
+
+    trace_rec* rr = &(tb->recs[tb->count]);
+    rr->ts   = mono_ns() - trace_t0;
+    rr->seq  = my_seq++;
+    rr->ptr  = (uintptr_t)ptr;
+    rr->size = size;
+    rr->tid  = tb->tid;
+    rr->op   = op;
+    rr->pad  = 0;
+
+    tb->count += 1;
+    if (tb->count == TRACE_BUF_RECS) {
+        flush_buf(tb);
+    }
+}
+
+// Blocks coming out of the backend are recorded after the call and
+// blocks going in are recorded before it. That way a block's free always
+// sorts after the allocation that produced it and before any reuse of
+// its address.
+
+void*
+xmalloc(size_t bytes)
+{
+    void* ptr = backend_xmalloc(bytes);
+    record(XTRACE_MALLOC, ptr, bytes);
+    return ptr;
+}
+
+void
+xfree(void* ptr)
+{
+    record(XTRACE_FREE, ptr, 0);
+    backend_xfree(ptr);
+}
+
+// logged as one free per block, so replays don't need to know about it
+void
+xfree_batch(void** ptrs, size_t nn)
+{
+    for (size_t ii = 0; ii < nn; ++ii) {
+        record(XTRACE_FREE, ptrs[ii], 0);
+    }
+    backend_xfree_batch(ptrs, nn);
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    record(XTRACE_REALLOC, prev, bytes);
+    void* ptr = backend_xrealloc(prev, bytes);
+    record(XTRACE_REALLOC_RET, ptr, bytes);
+    return ptr;
+}
+
+// replays as a plain xmalloc of the same total size
+void*
+xcalloc(size_t nn, size_t size)
+{
+    void* ptr = backend_xcalloc(nn, size);
+    record(XTRACE_MALLOC, ptr, ptr ? nn * size : 0);
+    return ptr;
+}
+
+const char*
+xmalloc_backend()
+{
+    return backend_xmalloc_backend();
+}
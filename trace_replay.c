@@ -0,0 +1,305 @@
+
+// Replays an allocation trace from trace_malloc.c against the linked
+// backend.
+//
+//   xmalloc-replay-opt TRACE
+//
+// Every traced thread gets a replay thread that makes the same calls, in
+// the same order, with the same sizes. A thread that frees or reallocs a
+// block another thread allocated waits until that allocation has been
+// replayed, so cross-thread frees stay cross-thread.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+static trace_rec* recs;
+static long nrecs;
+
+// need[ii] is the record that produced the block record ii gives back,
+// or -1 if that block was never seen.
+static long* need;
+
+// block produced by each record, once it has been replayed
+static void** blocks;
+
+// stands in for a null result so waiters can tell it has been replayed
+#define NULL_BLOCK ((void*)1)
+
+typedef struct replay_thread {
+    long* idxs;
+    long  count;
+} replay_thread;
+
+// Global order of the trace: by time, with ties broken by thread and
+// then by each thread's own sequence number.
+static
+int
+cmp_ts(const void* aa, const void* bb)
+{
+    const trace_rec* xx = aa;
+    const trace_rec* yy = bb;
+    if (xx->ts != yy->ts) {
+        return (xx->ts > yy->ts) - (xx->ts < yy->ts);
+    }
+    if (xx->tid != yy->tid) {
+        return (xx->tid > yy->tid) - (xx->tid < yy->tid);
+    }
+    return (xx->seq > yy->seq) - (xx->seq < yy->seq);
+}
+
+// Open-addressed map from a traced address to the record that produced
+// the block currently living there.
+
+typedef struct addr_map {
+    uint64_t* keys;
+    long*     vals;
+    long      mask;
+} addr_map;
+
+static
+long
+map_slot(addr_map* mm, uint64_t key)
+{
+    long ii = (key >> 4) * 0x9E3779B97F4A7C15UL & mm->mask;
+    while (mm->keys[ii] != 0 && mm->keys[ii] != key) {
+        ii = (ii + 1) & mm->mask;
+    }
+    return ii;
+}
+
+static
+void
+map_put(addr_map* mm, uint64_t key, long val)
+{
+    long ii = map_slot(mm, key);
+    mm->keys[ii] = key;
+    mm->vals[ii] = val;
+}
+
+static
+long
+map_take(addr_map* mm, uint64_t key)
+{
+    long ii = map_slot(mm, key);
+    if (mm->keys[ii] == 0) {
+        return -1;
+    }
+
+    long val = mm->vals[ii];
+
+    // backward-shift delete keeps probe chains intact
+    long jj = ii;
+    for (;;) {
+        mm->keys[ii] = 0;
+        for (;;) {
+            jj = (jj + 1) & mm->mask;
+            if (mm->keys[jj] == 0) {
+                return val;
+            }
+            long home = (mm->keys[jj] >> 4) * 0x9E3779B97F4A7C15UL & mm->mask;
+            if (ii <= jj ? (ii < home && home <= jj) : (ii < home || home <= jj)) {
+                continue;
+            }
+            break;
+        }
+        mm->keys[ii] = mm->keys[jj];
+        mm->vals[ii] = mm->vals[jj];
+        ii = jj;
+    }
+}
+
+// Work out which allocation each free and realloc refers to, walking the
+// trace in global order. Returns the number of traced threads.
+static
+int
+resolve_trace()
+{
+    addr_map mm;
+    long cap = 16;
+    while (cap < 2 * nrecs) {
+        cap *= 2;
+    }
+    mm.keys = calloc(cap, sizeof(uint64_t));
+    mm.vals = malloc(cap * sizeof(long));
+    mm.mask = cap - 1;
+
+    int nthreads = 0;
+    for (long ii = 0; ii < nrecs; ++ii) {
+        trace_rec* rr = &(recs[ii]);
+        need[ii] = -1;
+
+        if (rr->tid >= nthreads) {
+            nthreads = rr->tid + 1;
+        }
+
+        switch (rr->op) {
+        case XTRACE_MALLOC:
+        case XTRACE_REALLOC_RET:
+            if (rr->ptr) {
+                map_put(&mm, rr->ptr, ii);
+            }
+            break;
+        case XTRACE_FREE:
+        case XTRACE_REALLOC:
+            if (rr->ptr) {
+                need[ii] = map_take(&mm, rr->ptr);
+            }
+            break;
+        }
+    }
+
+    free(mm.keys);
+    free(mm.vals);
+    return nthreads;
+}
+
+static
+void*
+wait_block(long idx)
+{
+    void* ptr;
+    while ((ptr = __atomic_load_n(&blocks[idx], __ATOMIC_ACQUIRE)) == 0) {
+        sched_yield();
+    }
+    return ptr == NULL_BLOCK ? 0 : ptr;
+}
+
+static
+void
+put_block(long idx, void* ptr)
+{
+    __atomic_store_n(&blocks[idx], ptr ? ptr : NULL_BLOCK, __ATOMIC_RELEASE);
+}
+
+static
+void*
+replay_worker(void* arg)
+{
+    replay_thread* rt = arg;
+    void* realloc_result = 0;
+
+    for (long kk = 0; kk < rt->count; ++kk) {
+        long ii = rt->idxs[kk];
+        trace_rec* rr = &(recs[ii]);
+        void* prev = need[ii] >= 0 ? wait_block(need[ii]) : 0;
+
+        switch (rr->op) {
+        case XTRACE_MALLOC:
+            put_block(ii, xmalloc(rr->size));
+            break;
+        case XTRACE_FREE:
+            if (prev) {
+                xfree(prev);
+            }
+            break;
+        case XTRACE_REALLOC:
+            realloc_result = prev ? xrealloc(prev, rr->size) : xmalloc(rr->size);
+            break;
+        case XTRACE_REALLOC_RET:
+            put_block(ii, realloc_result);
+            break;
+        }
+    }
+    return 0;
+}
+
+static
+double
+now_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage:\n");
+        printf("\t%s TRACE\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    nrecs = st.st_size / sizeof(trace_rec);
+    if (nrecs == 0) {
+        printf("empty trace\n");
+        return 1;
+    }
+
+    // private mapping, so the trace can be sorted in place
+    recs = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (recs == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    close(fd);
+
+    qsort(recs, nrecs, sizeof(trace_rec), cmp_ts);
+
+    need = malloc(nrecs * sizeof(long));
+    blocks = calloc(nrecs, sizeof(void*));
+    int nthreads = resolve_trace();
+
+    replay_thread* rts = calloc(nthreads, sizeof(replay_thread));
+    for (long ii = 0; ii < nrecs; ++ii) {
+        rts[recs[ii].tid].count += 1;
+    }
+    for (int tt = 0; tt < nthreads; ++tt) {
+        rts[tt].idxs = malloc((rts[tt].count + 1) * sizeof(long));
+        rts[tt].count = 0;
+    }
+    for (long ii = 0; ii < nrecs; ++ii) {
+        replay_thread* rt = &(rts[recs[ii].tid]);
+        rt->idxs[rt->count++] = ii;
+    }
+
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    double t0 = now_secs();
+    for (int tt = 0; tt < nthreads; ++tt) {
+        int rv = pthread_create(&(threads[tt]), 0, replay_worker, &(rts[tt]));
+        assert(rv == 0);
+    }
+    for (int tt = 0; tt < nthreads; ++tt) {
+        int rv = pthread_join(threads[tt], 0);
+        assert(rv == 0);
+    }
+    double secs = now_secs() - t0;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("replayed %ld records from %d threads in %.3f s (traced run: %.3f s)\n",
+           nrecs, nthreads, secs, (recs[nrecs - 1].ts - recs[0].ts) / 1e9);
+    printf("%.0f records/s, peak RSS %ld KB\n", nrecs / secs, ru.ru_maxrss);
+
+    for (int tt = 0; tt < nthreads; ++tt) {
+        free(rts[tt].idxs);
+    }
+    free(rts);
+    free(threads);
+    free(need);
+    free(blocks);
+    munmap(recs, st.st_size);
+    return 0;
+}
@@ -7,4 +7,31 @@ void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
 
+// Zeroed array of nn items of size bytes each, or 0 if nn * size
+// overflows.
+void* xcalloc(size_t nn, size_t size);
+
+// Free nn blocks at once. Backends with locks take each one once per run
+// of neighbouring blocks that need it, rather than once per block, so
+// blocks that were allocated together are best freed together.
+void  xfree_batch(void** ptrs, size_t nn);
+
+// Name of the backend in use: "sys", "hwx" or "opt". Programs built with
+// select_malloc.c pick one at startup from $XMALLOC_BACKEND.
+const char* xmalloc_backend();
+
+// Code built only for the opt backend can inline its fast path, and use
+// opt_malloc.c's object pools (XMALLOC_POOL). Other code can't see either.
+#if defined(XMALLOC_OPT_INLINE) || defined(XMALLOC_POOL)
+#include "opt_malloc.h"
+#endif
+
+// Allocate or free a single T. The size is a compile-time constant, so a
+// backend that inlines its fast path can pick the size class statically.
+// XFREE_TYPED must only be given blocks of exactly sizeof(T) bytes.
+#ifndef XMALLOC_TYPED
+#define XMALLOC_TYPED(T)   ((T*)xmalloc(sizeof(T)))
+#define XFREE_TYPED(T, pp) xfree(pp)
+#endif
+
 #endif
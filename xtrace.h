@@ -0,0 +1,40 @@
+#ifndef XTRACE_H
+#define XTRACE_H
+
+#include <stdint.h>
+
+// On-disk format of an allocation trace: a flat array of trace_rec,
+// written by trace_malloc.c and read by trace_replay.c.
+//
+// Each thread fills its own buffer and appends it to the file when it is
+// full, so the file is only ordered within a thread. ts comes from the
+// monotonic clock, which every thread shares, so a block is freed at a
+// later ts than it was allocated. Records from one thread can share a ts;
+// seq counts each thread's records so that (ts, tid, seq) is a total
+// order that keeps every thread's own calls in sequence.
+//
+// An xrealloc is two records from the same thread: XTRACE_REALLOC, taken
+// before the call, for the block passed in, then XTRACE_REALLOC_RET for
+// the block returned.
+//
+// Only the process that started the trace writes to it; a child made
+// with fork() stops tracing.
+
+enum {
+    XTRACE_MALLOC      = 1,
+    XTRACE_FREE        = 2,
+    XTRACE_REALLOC     = 3,
+    XTRACE_REALLOC_RET = 4,
+};
+
+typedef struct trace_rec {
+    uint64_t ts;    // nanoseconds since the trace started
+    uint64_t seq;   // position among the records of the same thread
+    uint64_t ptr;   // block returned, or block given back
+    uint32_t size;  // bytes requested
+    uint32_t tid;   // traced threads are numbered from 0
+    uint32_t op;
+    uint32_t pad;   // always 0
+} trace_rec;
+
+#endif